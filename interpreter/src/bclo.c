@@ -0,0 +1,402 @@
+/**
+ * Closure compilation tier
+ *
+ * A middle ground between the tree walker and the bytecode VM, selected
+ * with --closures. A lambda body is compiled once into a tree of nodes,
+ * each run by a C function specialised for the shape of the expression it
+ * came from: a constant, a variable, an inline if, a call of one of the
+ * arithmetic or comparison builtins on two arguments, or a generic call.
+ * Running the tree skips the type dispatch of bval_eval_sexpr, and an
+ * operator node on two numbers computes its result directly instead of
+ * going through the generic arithmetic of builtin_op or builtin_ord.
+ *
+ * Scope is dynamic, so a node only assumes that a head symbol still names
+ * the builtin it did at compile time after looking it up. Anything else
+ * (a rebound operator, arguments of the wrong type, a division by zero)
+ * takes the generic path and behaves exactly as the tree walker does, and
+ * a head that turns out to be a macro is given the forms of the call
+ * instead of their values (see bclo_expand).
+ *
+ * Nodes are handed the btail of the body when their value is the value of
+ * the body, and hand tail calls back to bclo_exec as bvm_run does.
+ *
+ * Programs compiled ahead of time by blispc run on this tier, with the
+ * lambda bodies of the source attached as native functions instead of
+ * trees (see bclo_native).
+ */
+int bclo_enabled = 0;
+
+
+// binary operators with a node of their own
+bclo_op bclo_ops[] = {
+  { "+",  builtin_add, bclo_add },
+  { "-",  builtin_sub, bclo_sub },
+  { "*",  builtin_mul, bclo_mul },
+  { "/",  builtin_div, bclo_div },
+  { "<",  builtin_lt,  bclo_lt },
+  { ">",  builtin_gt,  bclo_gt },
+  { "<=", builtin_le,  bclo_le },
+  { ">=", builtin_ge,  bclo_ge },
+  { "=",  builtin_eq,  bclo_eq },
+  { "!=", builtin_ne,  bclo_ne },
+  { NULL, NULL, NULL }
+};
+
+
+// a node with room for count children, only counted when sizing the tree
+bnode* bclo_node(bclo_comp* c, bnode_fn run, bval* v, int count) {
+  bnode* n = NULL;
+
+  if (c->nodes) {
+    n = &c->nodes[c->nnodes];
+    n->run = run;
+    n->v = v;
+    n->count = count;
+    n->kids = &c->kids[c->nkids];
+  }
+
+  c->nnodes++;
+  c->nkids += count;
+  return n;
+}
+
+
+void bclo_kid(bnode* n, int i, bnode* kid) {
+  if (n) n->kids[i] = kid;
+}
+
+
+// a node for the value of v, as bval_eval would give it
+bnode* bclo_compile_expr(bclo_comp* c, bval* v) {
+  switch (BVAL_TYPE(v)) {
+    case BVAL_SYM:   return bclo_node(c, bclo_lookup, v, 0);
+    case BVAL_SEXPR: return bclo_compile_sexpr(c, v);
+    default:         return bclo_node(c, bclo_const, v, 0);
+  }
+}
+
+
+// a node for the elements of v evaluated as an S-expression
+bnode* bclo_compile_sexpr(bclo_comp* c, bval* v) {
+  if (!v->code || !v->code->fold) return bclo_compile_call(c, v);
+
+  // a folded S-expression runs its generic node once the fold fails
+  bnode* n = bclo_node(c, bclo_fold, v, 1);
+  bclo_kid(n, 0, bclo_compile_call(c, v));
+  return n;
+}
+
+
+bnode* bclo_compile_call(bclo_comp* c, bval* v) {
+  if (v->count == 0) return bclo_node(c, bclo_empty, v, 0);
+
+  // the value of the only element, unless that may be a macro. A lone
+  // S-expression keeps the tail position of the one holding it
+  if (v->count == 1) {
+    int type = BVAL_TYPE(v->cell[0]);
+    if (type == BVAL_SEXPR) return bclo_compile_sexpr(c, v->cell[0]);
+    if (type != BVAL_SYM) return bclo_compile_expr(c, v->cell[0]);
+
+    bnode* n = bclo_node(c, bclo_single, v, 1);
+    bclo_kid(n, 0, bclo_compile_expr(c, v->cell[0]));
+    return n;
+  }
+
+  // head, condition and the two branches
+  if (bvm_is_if(v)) {
+    bnode* n = bclo_node(c, bclo_if, v, 4);
+    bclo_kid(n, 0, bclo_compile_expr(c, v->cell[0]));
+    bclo_kid(n, 1, bclo_compile_expr(c, v->cell[1]));
+    bclo_kid(n, 2, bclo_compile_sexpr(c, v->cell[2]));
+    bclo_kid(n, 3, bclo_compile_sexpr(c, v->cell[3]));
+    return n;
+  }
+
+  bnode_fn run = bclo_apply;
+  if (v->count == 3 && BVAL_TYPE(v->cell[0]) == BVAL_SYM) {
+    for (bclo_op* op = bclo_ops; op->name; op++) {
+      if (strcmp(v->cell[0]->sym, op->name) == 0) run = op->run;
+    }
+  }
+
+  bnode* n = bclo_node(c, run, v, v->count);
+  for (int i = 0; i < v->count; i++) {
+    bclo_kid(n, i, bclo_compile_expr(c, v->cell[i]));
+  }
+  return n;
+}
+
+
+// the tree is sized first, then built in one block owned by body
+bcode* bclo_compile(bval* body) {
+  bclo_comp c = { NULL, NULL, 0, 0 };
+  bclo_compile_sexpr(&c, body);
+
+  size_t start = BPOOL_CLASS(sizeof(bcode));
+  size_t nodes = sizeof(bnode) * c.nnodes;
+  size_t kids = sizeof(bnode*) * c.nkids;
+  char* block = bmem_alloc(BVAL_IS_YOUNG(body), start + nodes + kids);
+
+  bcode* code = (bcode*) block;
+  memset(code, 0, sizeof(bcode));
+
+  c.nodes = (bnode*) (block + start);
+  c.kids = (bnode**) (block + start + nodes);
+  c.nnodes = 0;
+  c.nkids = 0;
+  code->tree = bclo_compile_sexpr(&c, body);
+  return code;
+}
+
+
+bcode* bclo_code(bval* body) {
+  if (!body->code) body->code = bclo_compile(body);
+  return body->code;
+}
+
+
+// run body as the C function fn from now on
+void bclo_native(bval* body, bnative fn) {
+  bcode* code = bmem_alloc(BVAL_IS_YOUNG(body), sizeof(bcode));
+  memset(code, 0, sizeof(bcode));
+  code->native = fn;
+
+  if (body->code) bvm_free(body->code);
+  body->code = code;
+}
+
+
+// run body in frame e, which it takes over, then any tail calls it makes
+bval* bclo_exec(benv* e, bval* body) {
+  body = bval_retain(body);
+
+  while (1) {
+    bgc_safepoint(e);
+    btail t = { NULL, NULL };
+    bcode* code = bclo_code(body);
+    bval* r = code->jit ? bjit_run(code->jit, e, body) : NULL;
+    if (!r) {
+      r = code->native
+        ? code->native(e, body, &t)
+        : code->tree->run(code->tree, e, &t);
+    }
+    bval_del(body);
+
+    if (r) {
+      benv_del(e);
+      return r;
+    }
+
+    if (t.frame) {
+      benv_splice(t.frame, e);
+      e = t.frame;
+    }
+    body = t.body;
+  }
+}
+
+
+/**
+ * Apply f to n argument values, which it takes over. In tail position
+ * (t set) a lambda or the branch of if or eval is handed back through t
+ * and NULL returned
+ */
+bval* bclo_call(benv* e, bval* f, bval** args, int n, btail* t) {
+  if (BVAL_TYPE(f) != BVAL_FUN) {
+    bval* err = bval_err(
+      "S-expression starts with incorrect type!"
+      "Given type %s, Expected type %s",
+      btype_name(BVAL_TYPE(f)), btype_name(BVAL_FUN)
+    );
+    bval_del(f);
+    for (int i = 0; i < n; i++) bval_del(args[i]);
+    return err;
+  }
+
+  // a full call of a lambda with plain formals binds the arguments
+  // straight into a frame
+  if (!BVAL_IS_BUILTIN(f) && (f->formals->flags & BVAL_F_PLAIN)
+      && f->env->count == 0 && f->formals->count == n) {
+    benv* frame = bvm_frame(f, args, n);
+    if (t) {
+      t->frame = frame;
+      t->body = bval_retain(f->body);
+      bval_del(f);
+      return NULL;
+    }
+    frame->parent = e;
+    bval* r = bclo_exec(frame, f->body);
+    bval_del(f);
+    return r;
+  }
+
+  bval* r = NULL;
+  if (t && BVAL_IS_BUILTIN(f)) {
+    t->body = bval_tail_expr(f, n, args);
+    if (t->body) {
+      bval_release(n, args);
+    } else {
+      r = bval_builtin(e, f, n, args);
+    }
+  } else if (t) {
+    t->frame = bval_bind(e, f, n, args, &r);
+    if (t->frame) t->body = bval_retain(f->body);
+  } else {
+    r = bval_call(e, f, n, args);
+  }
+
+  bval_del(f);
+  return r;
+}
+
+
+/**
+ * Evaluate the children of call node n into vals and return 0, or return 1
+ * with the value of n in r when they don't all get evaluated: for the
+ * first error, or a head that is a macro (see bclo_expand)
+ */
+int bclo_kids(bnode* n, benv* e, bval** vals, btail* t, bval** r) {
+  for (int i = 0; i < n->count; i++) {
+    bnode* k = n->kids[i];
+    vals[i] = k->run(k, e, NULL);
+
+    if (BVAL_TYPE(vals[i]) == BVAL_ERR) {
+      *r = bclo_abort(vals, i);
+      return 1;
+    }
+    if (i == 0 && bmac_applies(vals[0], n->count - 1)) {
+      *r = bclo_expand(e, vals[0], n->v, t);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * The value of the call v, whose head has been evaluated to the macro f,
+ * which is taken over: its rewrite from the forms of v, evaluated or in
+ * tail position handed back through t
+ */
+bval* bclo_expand(benv* e, bval* f, bval* v, btail* t) {
+  bval* x = bmac_rewrite(f, v);
+  if (!t) return bval_eval(e, x);
+  t->body = x;
+  return NULL;
+}
+
+
+// the error vals[n], after deleting the values before it
+bval* bclo_abort(bval** vals, int n) {
+  for (int i = 0; i < n; i++) bval_del(vals[i]);
+  return vals[n];
+}
+
+
+bval* bclo_const(bnode* n, benv* e, btail* t) {
+  return bval_retain(n->v);
+}
+
+
+bval* bclo_lookup(bnode* n, benv* e, btail* t) {
+  return benv_get(e, n->v);
+}
+
+
+bval* bclo_empty(bnode* n, benv* e, btail* t) {
+  return bval_sexpr();
+}
+
+
+bval* bclo_apply(bnode* n, benv* e, btail* t) {
+  bval* vals[n->count];
+  bval* r;
+  if (bclo_kids(n, e, vals, t, &r)) return r;
+  return bclo_call(e, vals[0], &vals[1], n->count - 1, t);
+}
+
+
+bval* bclo_single(bnode* n, benv* e, btail* t) {
+  bval* x = n->kids[0]->run(n->kids[0], e, NULL);
+  if (bmac_applies(x, 0)) return bclo_expand(e, x, n->v, t);
+  return x;
+}
+
+
+bval* bclo_if(bnode* n, benv* e, btail* t) {
+  bnode** k = n->kids;
+
+  bval* f = k[0]->run(k[0], e, NULL);
+  if (BVAL_TYPE(f) == BVAL_ERR) return f;
+  if (bmac_applies(f, 3)) return bclo_expand(e, f, n->v, t);
+
+  bval* cond = k[1]->run(k[1], e, NULL);
+  if (BVAL_TYPE(cond) == BVAL_ERR) {
+    bval_del(f);
+    return cond;
+  }
+
+  if (BVAL_TYPE(f) == BVAL_FUN && BVAL_IS_BUILTIN(f)
+      && f->builtin == builtin_if && BVAL_TYPE(cond) == BVAL_NUM) {
+    bnode* branch = bval_number(cond) ? k[2] : k[3];
+    bval_del(f);
+    bval_del(cond);
+    return branch->run(branch, e, t);
+  }
+
+  // generic call with the branches as data
+  bval* args[3] = {
+    cond,
+    bval_retain(n->v->cell[2]),
+    bval_retain(n->v->cell[3])
+  };
+  return bclo_call(e, f, args, 3, t);
+}
+
+
+bval* bclo_fold(bnode* n, benv* e, btail* t) {
+  bval* x = bopt_value(n->v);
+  if (x) return x;
+  return n->kids[0]->run(n->kids[0], e, t);
+}
+
+
+/**
+ * Binary operator nodes: when the head is still the builtin and both
+ * arguments are numbers (and ok holds) the result is computed in place.
+ * name_vals applies the operator to the head and argument values v
+ */
+#define BCLO_BINOP(name, fn, result, ok) \
+  bval* name(bnode* n, benv* e, btail* t) { \
+    bval* v[3]; \
+    bval* r; \
+    if (bclo_kids(n, e, v, t, &r)) return r; \
+    return name##_vals(e, v, t); \
+  } \
+  \
+  bval* name##_vals(benv* e, bval** v, btail* t) { \
+    if (BVAL_TYPE(v[0]) == BVAL_FUN && BVAL_IS_BUILTIN(v[0]) \
+        && v[0]->builtin == fn \
+        && BVAL_TYPE(v[1]) == BVAL_NUM && BVAL_TYPE(v[2]) == BVAL_NUM) { \
+      double x = bval_number(v[1]); \
+      double y = bval_number(v[2]); \
+      if (ok) { \
+        bval_del(v[0]); \
+        bval_del(v[1]); \
+        bval_del(v[2]); \
+        return bval_num(result); \
+      } \
+    } \
+    return bclo_call(e, v[0], &v[1], 2, t); \
+  }
+
+BCLO_BINOP(bclo_add, builtin_add, x + y, 1)
+BCLO_BINOP(bclo_sub, builtin_sub, x - y, 1)
+BCLO_BINOP(bclo_mul, builtin_mul, x * y, 1)
+BCLO_BINOP(bclo_div, builtin_div, x / y, y != 0)
+BCLO_BINOP(bclo_lt, builtin_lt, x < y, 1)
+BCLO_BINOP(bclo_gt, builtin_gt, x > y, 1)
+BCLO_BINOP(bclo_le, builtin_le, x <= y, 1)
+BCLO_BINOP(bclo_ge, builtin_ge, x >= y, 1)
+BCLO_BINOP(bclo_eq, builtin_eq, x == y, 1)
+BCLO_BINOP(bclo_ne, builtin_ne, x != y, 1)
@@ -1,6 +1,11 @@
+benv* benv_root = NULL;
+bbuiltin_info* benv_sexpr_builtins = NULL;
+
+
 benv* benv_new(void) {
-  benv* e = malloc(sizeof(benv));
+  benv* e = bpool_alloc(&benv_pool);
   e->count = 0;
+  e->young = bval_arena.depth && !bval_arena.paused;
   e->parent = NULL;
   e->syms = NULL;
   e->vals = NULL;
@@ -21,7 +26,7 @@ void benv_print(benv* e, int show_builtins) {
 void benv_print_level(benv* e, int show_builtins, int l) {
   for (int i = 0; i < e->count; i++) {
     bval* v = e->vals[i];
-    if (show_builtins || v->type != BVAL_FUN || (v->type == BVAL_FUN && !v->builtin)) {
+    if (show_builtins || BVAL_TYPE(v) != BVAL_FUN || (BVAL_TYPE(v) == BVAL_FUN && !BVAL_IS_BUILTIN(v))) {
       for (int t = 0; t < l; t++) printf("  ");
       printf("  \"%s\":  ", e->syms[i]);
       bval_println(v);
@@ -42,45 +47,173 @@ void benv_print_level(benv* e, int show_builtins, int l) {
 
 void benv_del(benv* e) {
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
+    if (e != benv_root) BSYM(e->syms[i])->shadows--;
     bval_del(e->vals[i]);
   }
   if (e->syms) free(e->syms);
   if (e->vals) free(e->vals);
-  free(e);
+  bpool_free(&benv_pool, e);
 }
 
 
-// linear scan through symbols for matching value
-bval* benv_get(benv* e, bval* k) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return bval_copy(e->vals[i]);
+/**
+ * Scope index
+ *
+ * Call frames hold a handful of names and are fastest to scan, but the root
+ * scope holds every builtin and global definition and is searched on each
+ * global reference. Once a scope has more than BENV_INDEX_MIN entries it is
+ * hash indexed: an open addressing table of slot numbers, hashed on the
+ * interned name pointer and kept at most half full. syms and vals stay in
+ * insertion order, so printing and copying are unchanged.
+ *
+ * Scopes never shrink, so whether a scope is indexed and how big its table
+ * is both follow from count. The table lives in the same block as syms,
+ * after room for benv_room(count) names, which keeps benv itself small.
+ */
+#define BENV_HASH(sym, cap) \
+  ((unsigned int) ((((uintptr_t) (sym) >> 4) * 0x9E3779B97F4A7C15ull) >> 32) \
+    & ((cap) - 1))
+
+// table size for an indexed scope: a power of two at least twice count
+int benv_index_cap(int count) {
+  int cap = 2;
+  while (cap < 2 * count) cap *= 2;
+  return cap;
+}
+
+
+// entries syms and vals have room for
+int benv_room(int count) {
+  return count > BENV_INDEX_MIN ? benv_index_cap(count) / 2 : count;
+}
+
+
+// slots are stored plus one, so zero marks an empty bucket
+int* benv_index(benv* e) {
+  return (int*) (e->syms + benv_room(e->count));
+}
+
+
+void benv_index_add(benv* e, int i) {
+  int cap = benv_index_cap(e->count);
+  int* index = benv_index(e);
+
+  unsigned int h = BENV_HASH(e->syms[i], cap);
+  while (index[h]) h = (h + 1) & (cap - 1);
+  index[h] = i + 1;
+}
+
+
+void benv_index_build(benv* e) {
+  memset(benv_index(e), 0, sizeof(int) * benv_index_cap(e->count));
+  for (int i = 0; i < e->count; i++) benv_index_add(e, i);
+}
+
+
+// size syms and vals for the current count
+void benv_alloc_slots(benv* e) {
+  int room = benv_room(e->count);
+  size_t index = e->count > BENV_INDEX_MIN
+    ? sizeof(int) * benv_index_cap(e->count)
+    : 0;
+
+  e->syms = realloc(e->syms, sizeof(char*) * room + index);
+  e->vals = realloc(e->vals, sizeof(bval*) * room);
+}
+
+
+// slot of sym in this scope only, or -1
+int benv_find(benv* e, char* sym) {
+  if (e->count > BENV_INDEX_MIN) {
+    int cap = benv_index_cap(e->count);
+    int* index = benv_index(e);
+
+    unsigned int h = BENV_HASH(sym, cap);
+    while (index[h]) {
+      if (e->syms[index[h] - 1] == sym) return index[h] - 1;
+      h = (h + 1) & (cap - 1);
     }
+    return -1;
   }
 
-  // look in parent scope
-  if (e->parent) {
-    return benv_get(e->parent, k);
-  } else {
+  // linear scan, names are interned
+  for (int i = 0; i < e->count; i++) {
+    if (e->syms[i] == sym) return i;
+  }
+  return -1;
+}
+
+
+bval* benv_get(benv* e, bval* k) {
+  // a reference inlined when loaded, while the constant it names holds
+  if (k->inlined && bopt_valid(k->inlined->fold)) {
+    return bval_retain(k->inlined->fold->value);
+  }
+
+  // a name no other scope binds can only be a global
+  bsym* name = BSYM(k->sym);
+  if (!name->shadows && benv_root) {
+    if (name->global >= 0) return bval_retain(benv_root->vals[name->global]);
     return bval_err("Unbound symbol '%s'", k->sym);
   }
+
+  // a resolved reference goes straight to its slot, as long as the slot
+  // still holds the name and no scope in between binds it
+  if (k->slot >= 0) {
+    benv* s = e;
+    int depth = 0;
+    while (s && depth < k->depth && benv_find(s, k->sym) < 0) {
+      s = s->parent;
+      depth++;
+    }
+    if (s && depth == k->depth && k->slot < s->count
+        && s->syms[k->slot] == k->sym) {
+      return bval_retain(s->vals[k->slot]);
+    }
+  }
+
+  // otherwise walk out through the scopes, call frames are scanned in place
+  int depth = 0;
+  for (benv* s = e; s; s = s->parent, depth++) {
+    int i = -1;
+    if (s->count > BENV_INDEX_MIN) {
+      i = benv_find(s, k->sym);
+    } else {
+      for (int j = 0; j < s->count; j++) {
+        if (s->syms[j] == k->sym) { i = j; break; }
+      }
+    }
+
+    if (i >= 0) {
+      // remember where a local was found, globals are indexed already
+      if (s->parent) {
+        k->depth = depth;
+        k->slot = i;
+      }
+      return bval_retain(s->vals[i]);
+    }
+  }
+
+  return bval_err("Unbound symbol '%s'", k->sym);
 }
 
 
 benv* benv_copy(benv* e) {
-  benv* n = malloc(sizeof(benv));
+  benv* n = bpool_alloc(&benv_pool);
 
   n->parent = e->parent;
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(char*) * n->count);
+  n->young = bval_arena.depth && !bval_arena.paused;
+  n->syms = NULL;
+  n->vals = NULL;
+  if (n->count) benv_alloc_slots(n);
 
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = bval_copy(e->vals[i]);
+    n->syms[i] = e->syms[i];
+    n->vals[i] = bval_retain(e->vals[i]);
+    BSYM(n->syms[i])->shadows++;
   }
+  if (n->count > BENV_INDEX_MIN) benv_index_build(n);
 
   return n;
 }
@@ -93,75 +226,105 @@ void benv_def(benv* e, bval* k, bval* v) {
 
 void benv_put(benv* e, bval* k, bval* v) {
 
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      bval_del(e->vals[i]);
-      e->vals[i] = bval_copy(v);
-      return;
-    }
+  // a young env can share nursery values, an old one needs them promoted
+  v = e->young ? bval_retain(v) : bval_promote(v);
+
+  int i = benv_find(e, k->sym);
+  if (i >= 0) {
+    // values folded from the old binding no longer hold
+    if (e == benv_root) BSYM(k->sym)->version++;
+    bval_del(e->vals[i]);
+    e->vals[i] = v;
+    return;
   }
 
   // no pre-existing variable found
+  benv_append(e, k->sym, v);
+}
 
+
+/**
+ * Add a binding for a name not yet in scope e, taking over v
+ */
+void benv_append(benv* e, char* sym, bval* v) {
   e->count++;
-  e->vals = realloc(e->vals, sizeof(bval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  int grown = benv_room(e->count) != benv_room(e->count - 1);
+  if (grown) benv_alloc_slots(e);
+
+  e->vals[e->count - 1] = v;
+  e->syms[e->count - 1] = sym;
 
-  e->vals[e->count - 1] = bval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  if (e == benv_root) {
+    BSYM(sym)->global = e->count - 1;
+  } else {
+    BSYM(sym)->shadows++;
+  }
+
+  // a resized table is rebuilt, otherwise only the new name is added
+  if (e->count > BENV_INDEX_MIN) {
+    if (grown) {
+      benv_index_build(e);
+    } else {
+      benv_index_add(e, e->count - 1);
+    }
+  }
+}
+
+
+/**
+ * A tail call's frame takes the place of its caller's frame: it inherits
+ * the caller's parent and any of the caller's bindings it does not shadow,
+ * since under dynamic scope the callee can still see those. The caller's
+ * frame is deleted
+ */
+void benv_splice(benv* frame, benv* caller) {
+  for (int i = 0; i < caller->count; i++) {
+    if (benv_find(frame, caller->syms[i]) >= 0) continue;
+    bval* v = caller->vals[i];
+    benv_append(frame, caller->syms[i],
+      frame->young ? bval_retain(v) : bval_promote(v));
+  }
+
+  frame->parent = caller->parent;
+  benv_del(caller);
 }
 
-void benv_add_builtin(benv* e, char* name, bbuiltin fn) {
-  bval* k = bval_sym(name);
-  bval* v = bval_fun(fn, name);
+
+void benv_add_builtin(benv* e, bbuiltin_info* info) {
+  bval* k = bval_sym(info->name);
+  bval* v = bval_fun(info);
   benv_put(e, k, v);
   bval_del(k);
   bval_del(v);
 }
 
 
+// a builtin still written to take its arguments as an S-expression, with
+// any number of arguments of any type
+void benv_add_builtin_sexpr(benv* e, char* name, bbuiltin_sexpr fn) {
+  bbuiltin_info* info = calloc(1, sizeof(bbuiltin_info));
+  info->name = name;
+  info->max = -1;
+  info->sexpr = fn;
+  info->next = benv_sexpr_builtins;
+  benv_sexpr_builtins = info;
+  benv_add_builtin(e, info);
+}
+
+
+// free the entries made by benv_add_builtin_sexpr, once no value refers
+// to them
+void benv_release_builtins(void) {
+  while (benv_sexpr_builtins) {
+    bbuiltin_info* next = benv_sexpr_builtins->next;
+    free(benv_sexpr_builtins);
+    benv_sexpr_builtins = next;
+  }
+}
+
+
 void benv_add_builtins(benv* e) {
-  // list methods
-  benv_add_builtin(e, "list", builtin_list);
-  benv_add_builtin(e, "cons", builtin_cons);
-  benv_add_builtin(e, "len",  builtin_len);
-  benv_add_builtin(e, "head", builtin_head);
-  benv_add_builtin(e, "tail", builtin_tail);
-  benv_add_builtin(e, "init", builtin_init);
-  benv_add_builtin(e, "eval", builtin_eval);
-  benv_add_builtin(e, "join", builtin_join);
-
-
-  benv_add_builtin(e, "def",   builtin_def);
-  benv_add_builtin(e, "var",   builtin_var);
-  benv_add_builtin(e, "env",   builtin_env);
-  benv_add_builtin(e, "\\",    builtin_lambda);
-  benv_add_builtin(e, "type",  builtin_type);
-  benv_add_builtin(e, "load",  builtin_load);
-  benv_add_builtin(e, "read",  builtin_read);
-  benv_add_builtin(e, "print", builtin_print);
-  benv_add_builtin(e, "show",  builtin_show);
-  benv_add_builtin(e, "error", builtin_error);
-  benv_add_builtin(e, "exit",  builtin_exit);
-  benv_add_builtin(e, "fread", builtin_fread);
-  benv_add_builtin(e, "fwrite", builtin_fwrite);
-  benv_add_builtin(e, "string", builtin_to_string);
-
-
-  // math methods
-  benv_add_builtin(e, "+", builtin_add);
-  benv_add_builtin(e, "-", builtin_sub);
-  benv_add_builtin(e, "*", builtin_mul);
-  benv_add_builtin(e, "/", builtin_div);
-  benv_add_builtin(e, "%", builtin_mod);
-  benv_add_builtin(e, "not", builtin_not);
-
-  benv_add_builtin(e, "if", builtin_if);
-  benv_add_builtin(e, "<",  builtin_lt);
-  benv_add_builtin(e, ">",  builtin_gt);
-  benv_add_builtin(e, "<=", builtin_le);
-  benv_add_builtin(e, ">=", builtin_ge);
-  benv_add_builtin(e, "=",  builtin_eq);
-  benv_add_builtin(e, "!=", builtin_ne);
+  for (bbuiltin_info* b = builtin_table; b->name; b++) {
+    benv_add_builtin(e, b);
+  }
 }
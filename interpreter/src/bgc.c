@@ -0,0 +1,287 @@
+/**
+ * Tracing collector
+ *
+ * Reference counts free most values the moment they die, but a reference
+ * dropped on an error path, or a structure that ends up sharing itself,
+ * would stay allocated forever. At safe points the collector marks
+ * everything reachable from its roots and sweeps the rest out of the value
+ * pool.
+ *
+ * The roots are the environment chain of the code being run and the
+ * evaluator stack: the forms a load is still working through, pushed with
+ * bgc_push. Safe points are the end of every loaded form, nested loads
+ * included, and the top of each evaluator's call loop, so a long running
+ * form collects too.
+ *
+ * Between two top-level forms those are all the roots there are. Inside a
+ * form, values are also held by C locals, call frames the chain doesn't
+ * reach and the nursery, none of which can be enumerated, but each of them
+ * holds a reference. So first every reference a pool node holds to another
+ * is taken off its count (bgc_count): a node left with references is held
+ * from outside the pool and becomes a root as well. Young nodes are never
+ * collected, only looked through by their references.
+ *
+ * Nodes are enumerated with bpool_next, through the slabs or, with
+ * -DBLISP_MALLOC, the list of malloc'd nodes.
+ */
+bgc bval_gc = { NULL, 0, 0, BGC_MIN_THRESHOLD, 0, 0, 0, 0, 0, NULL };
+
+
+void bgc_push(bval* v) {
+  if (bval_gc.count == bval_gc.cap) {
+    bval_gc.cap = bval_gc.cap ? bval_gc.cap * 2 : 16;
+    bval_gc.roots = realloc(bval_gc.roots, sizeof(bval*) * bval_gc.cap);
+  }
+  bval_gc.roots[bval_gc.count++] = v;
+}
+
+
+void bgc_pop(void) {
+  bval_gc.count--;
+}
+
+
+void bgc_mark(bval* v) {
+  if (BVAL_IS_IMM(v) || (v->flags & (BVAL_F_MARK | BVAL_F_ARENA))) return;
+  v->flags |= BVAL_F_MARK;
+
+  switch (v->type) {
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      if (v->cell) bgc_mark_vec(BVEC(v));
+      if (v->code && v->code->fold) bgc_mark(v->code->fold->value);
+      break;
+
+    case BVAL_SYM:
+      if (v->inlined) bgc_mark(v->inlined->fold->value);
+      break;
+
+    case BVAL_FUN:
+      if (!BVAL_IS_BUILTIN(v)) {
+        bgc_mark(v->formals);
+        bgc_mark(v->body);
+        bgc_mark_env(v->env);
+      }
+      break;
+
+    case BVAL_STR:
+      if (v->base) bgc_mark(v->base);
+      break;
+
+    case BVAL_SEQ:
+      if (v->kind != BSEQ_RANGE) {
+        bgc_mark(v->src);
+        if (v->fn) bgc_mark(v->fn);
+      }
+      break;
+  }
+}
+
+
+// every element a block holds, seen from any of the slices viewing it
+void bgc_mark_vec(bvec* b) {
+  if (b->mark) return;
+  b->mark = 1;
+  for (int i = b->front; i < b->back; i++) bgc_mark(b->cell[i]);
+}
+
+
+void bgc_mark_env(benv* e) {
+  for (int i = 0; i < e->count; i++) bgc_mark(e->vals[i]);
+}
+
+
+/**
+ * Add n to the count of each pool node v holds a reference to, once for a
+ * block shared by several slices. Taking them off (n = -1) flags each
+ * block counted, adding them back (n = 1) clears it
+ */
+void bgc_count(bval* v, int n) {
+  switch (v->type) {
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      if (v->cell && BVEC(v)->mark == (n < 0 ? 0 : 1)) {
+        bvec* b = BVEC(v);
+        b->mark = n < 0;
+        for (int i = b->front; i < b->back; i++) bgc_ref(b->cell[i], n);
+      }
+      if (v->code && v->code->fold) bgc_ref(v->code->fold->value, n);
+      break;
+
+    case BVAL_SYM:
+      if (v->inlined) bgc_ref(v->inlined->fold->value, n);
+      break;
+
+    case BVAL_FUN:
+      if (!BVAL_IS_BUILTIN(v)) {
+        bgc_ref(v->formals, n);
+        bgc_ref(v->body, n);
+        for (int i = 0; i < v->env->count; i++) bgc_ref(v->env->vals[i], n);
+      }
+      break;
+
+    case BVAL_STR:
+      if (v->base) bgc_ref(v->base, n);
+      break;
+
+    case BVAL_SEQ:
+      if (v->kind != BSEQ_RANGE) {
+        bgc_ref(v->src, n);
+        if (v->fn) bgc_ref(v->fn, n);
+      }
+      break;
+  }
+}
+
+
+void bgc_ref(bval* v, int n) {
+  if (!BVAL_IS_IMM(v) && !BVAL_IS_YOUNG(v)) v->rc += n;
+}
+
+
+// drop a dead node's reference to a child that is being kept
+void bgc_unref(bval* v) {
+  if (!BVAL_IS_IMM(v) && (v->flags & BVAL_F_MARK)) v->rc--;
+}
+
+
+// free what an unreachable node owns, without touching other dead nodes
+void bgc_release(bval* v) {
+  switch (v->type) {
+    case BVAL_ERR: bmem_free(v->err); break;
+    case BVAL_SYM:
+      if (v->inlined) {
+        bgc_unref(v->inlined->fold->value);
+        v->inlined->fold->value = NULL;
+      }
+      bvm_free(v->inlined);
+      break;
+
+    case BVAL_STR:
+      if (v->base) {
+        bgc_unref(v->base);
+      } else {
+        bmem_free(v->str);
+      }
+      break;
+
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      // the block goes with the last of the slices viewing it
+      if (v->cell && --BVEC(v)->rc == 0) {
+        bvec* b = BVEC(v);
+        for (int i = b->front; i < b->back; i++) bgc_unref(b->cell[i]);
+        bmem_free(b);
+      }
+      if (v->code && v->code->fold) {
+        bgc_unref(v->code->fold->value);
+        v->code->fold->value = NULL;
+      }
+      bvm_free(v->code);
+      break;
+
+    case BVAL_FUN:
+      if (!BVAL_IS_BUILTIN(v)) {
+        bgc_unref(v->formals);
+        bgc_unref(v->body);
+        for (int i = 0; i < v->env->count; i++) {
+          bgc_unref(v->env->vals[i]);
+          BSYM(v->env->syms[i])->shadows--;
+        }
+        free(v->env->syms);
+        free(v->env->vals);
+        bpool_free(&benv_pool, v->env);
+      }
+      break;
+
+    case BVAL_SEQ:
+      if (v->kind != BSEQ_RANGE) {
+        bgc_unref(v->src);
+        if (v->fn) bgc_unref(v->fn);
+      }
+      break;
+  }
+}
+
+
+void bgc_collect(benv* e) {
+  clock_t start = clock();
+  long freed = 0;
+
+  if (bval_arena.depth) bgc_mark_held();
+  for (benv* x = e; x; x = x->parent) bgc_mark_env(x);
+  for (int i = 0; i < bval_gc.count; i++) bgc_mark(bval_gc.roots[i]);
+
+  // release the payloads of dead nodes first, so no dead node is freed
+  // while another one may still look at it
+  for (int pass = 0; pass < 2; pass++) {
+    bpool_iter it;
+    bpool_iter_start(&it, &bval_pool);
+
+    for (bval* v; (v = bpool_next(&it));) {
+      if (v->flags & BVAL_F_MARK) {
+        if (pass == 1) {
+          v->flags &= ~BVAL_F_MARK;
+          if ((v->type == BVAL_SEXPR || v->type == BVAL_QEXPR) && v->cell) {
+            BVEC(v)->mark = 0;
+          }
+        }
+      } else if (pass == 0) {
+        bgc_release(v);
+      } else {
+        bpool_free(&bval_pool, v);
+        freed++;
+      }
+    }
+  }
+
+  double pause = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+  bval_gc.collections++;
+  bval_gc.freed += freed;
+  bval_gc.pause_total += pause;
+  if (pause > bval_gc.pause_max) bval_gc.pause_max = pause;
+
+  // next collection once the live heap has doubled
+  bval_gc.threshold = bval_pool.live * 2;
+  if (bval_gc.threshold < BGC_MIN_THRESHOLD) bval_gc.threshold = BGC_MIN_THRESHOLD;
+  bval_gc.requested = 0;
+
+  if (bval_gc.hook) bval_gc.hook(&bval_gc);
+}
+
+
+// mark the pool nodes referenced from outside the pool, see above
+void bgc_mark_held(void) {
+  bval** held = NULL;
+  int count = 0;
+  int cap = 0;
+
+  for (int pass = 0; pass < 3; pass++) {
+    bpool_iter it;
+    bpool_iter_start(&it, &bval_pool);
+
+    for (bval* v; (v = bpool_next(&it));) {
+      if (pass == 0) {
+        bgc_count(v, -1);
+      } else if (pass == 2) {
+        bgc_count(v, 1);
+      } else if (v->rc > 0) {
+        if (count == cap) {
+          cap = cap ? cap * 2 : 256;
+          held = realloc(held, sizeof(bval*) * cap);
+        }
+        held[count++] = v;
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++) bgc_mark(held[i]);
+  free(held);
+}
+
+
+// collect if one is due
+void bgc_safepoint(benv* e) {
+  if (bval_gc.requested || bval_pool.live > bval_gc.threshold) bgc_collect(e);
+}
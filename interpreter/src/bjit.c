@@ -0,0 +1,457 @@
+/**
+ * Template JIT for numeric lambdas (x86-64)
+ *
+ * With --jit, a lambda body is also compiled to machine code when the
+ * lambda is built, if it only uses numbers, its own formals, if, the
+ * binary builtins + - * / < > <= >= = !=, unary -, and calls to itself by
+ * name with every argument. Each form is emitted from a fixed template
+ * working on unboxed doubles: the value at hand is in xmm0, pending
+ * operands are spilled to slots in the native frame, the formals are an
+ * array of doubles and self calls are direct native calls (or a jump back
+ * to the top for a call in tail position).
+ *
+ * Scope is dynamic, so the machine code is only entered when the body is
+ * about to run (see bjit_run) and the frame holds numbers for every formal,
+ * every operator and if still name their builtins and the self name still
+ * names a lambda with this body and formals. Nothing in such a body can
+ * rebind a name, so that holds for every call it makes. A division by
+ * zero, or running short of native stack, bails out of the machine code
+ * and the body is run by the interpreter instead, which is safe to do
+ * since the body has no side effects.
+ *
+ * Everywhere else (another architecture, a body using anything more) the
+ * interpreter runs the body as usual.
+ */
+int bjit_enabled = 0;
+
+// marks a body found not to be numeric, so it isn't tried again
+bjit bjit_none;
+
+#ifdef BJIT_SUPPORTED
+
+// set by machine code that bails out (to 2 when out of stack), and the
+// lowest stack address it may use before it does
+char bjit_bailed;
+uintptr_t bjit_limit;
+
+// while the interpreter reruns a body that ran out of stack, the native
+// stack address it started at, so that the calls it makes stay interpreted
+uintptr_t bjit_floor;
+
+// native stack the machine code may use on one entry
+#ifndef BJIT_STACK
+#define BJIT_STACK (1 << 20)
+#endif
+
+// emit the given bytes
+#define BJIT(a, ...) bjit_code(a, (unsigned char[]) { __VA_ARGS__ }, \
+  sizeof((unsigned char[]) { __VA_ARGS__ }))
+
+// binary operators: the builtin, then either the instruction combining
+// xmm0 and xmm1 into xmm0 or the cmpsd predicate comparing them, with the
+// operands swapped first for > and >=
+bjit_op bjit_ops[] = {
+  { "+",  builtin_add, 0x58, -1, 0 },
+  { "-",  builtin_sub, 0x5c, -1, 0 },
+  { "*",  builtin_mul, 0x59, -1, 0 },
+  { "/",  builtin_div, 0x5e, -1, 0 },
+  { "<",  builtin_lt,  0, 1, 0 },
+  { "<=", builtin_le,  0, 2, 0 },
+  { ">",  builtin_gt,  0, 1, 1 },
+  { ">=", builtin_ge,  0, 2, 1 },
+  { "=",  builtin_eq,  0, 0, 0 },
+  { "!=", builtin_ne,  0, 4, 0 },
+  { NULL, NULL, 0, 0, 0 }
+};
+
+
+void bjit_code(bjit_asm* a, unsigned char* bytes, int n) {
+  if (a->len + n > a->cap) {
+    a->cap = (a->len + n) * 2;
+    a->code = realloc(a->code, a->cap);
+  }
+  memcpy(a->code + a->len, bytes, n);
+  a->len += n;
+}
+
+
+void bjit_u32(bjit_asm* a, uint32_t x) {
+  bjit_code(a, (unsigned char*) &x, 4);
+}
+
+
+void bjit_u64(bjit_asm* a, uint64_t x) {
+  bjit_code(a, (unsigned char*) &x, 8);
+}
+
+
+// mov rax, x
+void bjit_rax(bjit_asm* a, uint64_t x) {
+  BJIT(a, 0x48, 0xb8);
+  bjit_u64(a, x);
+}
+
+
+// xmm0 = d
+void bjit_num(bjit_asm* a, double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  bjit_rax(a, bits);
+  BJIT(a, 0x66, 0x48, 0x0f, 0x6e, 0xc0);
+}
+
+
+// movsd between xmm0 or xmm1 and spill slot k, [rsp + 8k]
+void bjit_slot(bjit_asm* a, int store, int xmm, int k) {
+  if (k + 1 > a->slots) a->slots = k + 1;
+  BJIT(a, 0xf2, 0x0f, store ? 0x11 : 0x10, xmm ? 0x8c : 0x84, 0x24);
+  bjit_u32(a, 8 * k);
+}
+
+
+// movsd between xmm0 and formal i, [rbx + 8i]
+void bjit_formal(bjit_asm* a, int store, int i) {
+  BJIT(a, 0xf2, 0x0f, store ? 0x11 : 0x10, 0x83);
+  bjit_u32(a, 8 * i);
+}
+
+
+// a jump whose rel32 operand is patched later, returns its offset
+int bjit_jump(bjit_asm* a, unsigned char cc) {
+  if (cc) BJIT(a, 0x0f, cc);
+  else BJIT(a, 0xe9);
+  bjit_u32(a, 0);
+  return a->len - 4;
+}
+
+
+void bjit_patch(bjit_asm* a, int at, int target) {
+  uint32_t rel = target - (at + 4);
+  memcpy(a->code + at, &rel, 4);
+}
+
+
+// a jump to the epilogue
+void bjit_exit(bjit_asm* a, unsigned char cc) {
+  if (a->nexits == a->cap_exits) {
+    a->cap_exits = a->cap_exits ? a->cap_exits * 2 : 8;
+    a->exits = realloc(a->exits, sizeof(int) * a->cap_exits);
+  }
+  a->exits[a->nexits++] = bjit_jump(a, cc);
+}
+
+
+// bjit_bailed = why, then leave
+void bjit_bail(bjit_asm* a, char why) {
+  bjit_rax(a, (uintptr_t) &bjit_bailed);
+  BJIT(a, 0xc6, 0x00, why);
+  bjit_exit(a, 0);
+}
+
+
+// sym must name fn whenever the code runs
+void bjit_guard(bjit_asm* a, bval* sym, bbuiltin fn) {
+  bjit* j = a->jit;
+
+  for (int i = 0; i < j->nguards; i++) {
+    if (j->guards[i]->sym == sym->sym) return;
+  }
+
+  if (j->nguards == a->cap_guards) {
+    a->cap_guards = a->cap_guards ? a->cap_guards * 2 : 4;
+    j->guards = realloc(j->guards, sizeof(bval*) * a->cap_guards);
+    j->builtins = realloc(j->builtins, sizeof(bbuiltin) * a->cap_guards);
+  }
+  j->guards[j->nguards] = sym;
+  j->builtins[j->nguards] = fn;
+  j->nguards++;
+}
+
+
+int bjit_formal_index(bjit* j, char* sym) {
+  for (int i = 0; i < j->nformals; i++) {
+    if (j->formals[i] == sym) return i;
+  }
+  return -1;
+}
+
+
+// xmm0 = the value of v, 0 if it isn't numeric
+int bjit_expr(bjit_asm* a, bval* v, int slot) {
+  switch (BVAL_TYPE(v)) {
+    case BVAL_NUM:
+      bjit_num(a, bval_number(v));
+      return 1;
+
+    case BVAL_SYM: {
+      int i = bjit_formal_index(a->jit, v->sym);
+      if (i < 0) return 0;
+      bjit_formal(a, 0, i);
+      return 1;
+    }
+
+    case BVAL_SEXPR:
+      return bjit_sexpr(a, v, slot, 0);
+  }
+  return 0;
+}
+
+
+// xmm0 = the elements of v evaluated as an S-expression, using spill
+// slots from slot up. A self call in tail position jumps back to the top
+int bjit_sexpr(bjit_asm* a, bval* v, int slot, int tail) {
+  bjit* j = a->jit;
+
+  if (v->count == 1) return bjit_expr(a, v->cell[0], slot);
+  if (v->count == 0 || BVAL_TYPE(v->cell[0]) != BVAL_SYM) return 0;
+
+  bval* head = v->cell[0];
+  if (bjit_formal_index(j, head->sym) >= 0) return 0;
+
+  if (bvm_is_if(v)) {
+    bjit_guard(a, head, builtin_if);
+    if (!bjit_expr(a, v->cell[1], slot)) return 0;
+
+    // ucomisd against 0, NaN is true as in C
+    BJIT(a, 0x66, 0x0f, 0x57, 0xc9);
+    BJIT(a, 0x66, 0x0f, 0x2e, 0xc1);
+    int then = bjit_jump(a, 0x8a);
+    int other = bjit_jump(a, 0x84);
+
+    bjit_patch(a, then, a->len);
+    if (!bjit_sexpr(a, v->cell[2], slot, tail)) return 0;
+    int end = bjit_jump(a, 0);
+
+    bjit_patch(a, other, a->len);
+    if (!bjit_sexpr(a, v->cell[3], slot, tail)) return 0;
+    bjit_patch(a, end, a->len);
+    return 1;
+  }
+
+  // unary minus
+  if (v->count == 2 && strcmp(head->sym, "-") == 0) {
+    bjit_guard(a, head, builtin_sub);
+    if (!bjit_expr(a, v->cell[1], slot)) return 0;
+    bjit_rax(a, 0x8000000000000000ull);
+    BJIT(a, 0x66, 0x48, 0x0f, 0x6e, 0xc8);
+    BJIT(a, 0x66, 0x0f, 0x57, 0xc1);
+    return 1;
+  }
+
+  for (bjit_op* op = bjit_ops; op->name; op++) {
+    if (strcmp(head->sym, op->name) != 0) continue;
+    if (v->count != 3) return 0;
+    bjit_guard(a, head, op->builtin);
+
+    if (!bjit_expr(a, v->cell[1], slot)) return 0;
+    bjit_slot(a, 1, 0, slot);
+    if (!bjit_expr(a, v->cell[2], slot + 1)) return 0;
+
+    // xmm1 = right, xmm0 = left, or the other way round
+    BJIT(a, 0x66, 0x0f, 0x28, 0xc8);
+    bjit_slot(a, 0, 0, slot);
+    if (op->swap) {
+      BJIT(a, 0x66, 0x0f, 0x28, 0xd0);
+      BJIT(a, 0x66, 0x0f, 0x28, 0xc1);
+      BJIT(a, 0x66, 0x0f, 0x28, 0xca);
+    }
+
+    if (op->cmp < 0) {
+
+      // builtin_div fails on a zero divisor, let the interpreter say so
+      if (op->builtin == builtin_div) {
+        BJIT(a, 0x66, 0x0f, 0x57, 0xd2);
+        BJIT(a, 0x66, 0x0f, 0x2e, 0xca);
+        int nan = bjit_jump(a, 0x8a);
+        int ok = bjit_jump(a, 0x85);
+        bjit_bail(a, 1);
+        bjit_patch(a, nan, a->len);
+        bjit_patch(a, ok, a->len);
+      }
+      BJIT(a, 0xf2, 0x0f, op->code, 0xc1);
+      return 1;
+    }
+
+    // cmpsd gives a mask, and it with 1.0
+    BJIT(a, 0xf2, 0x0f, 0xc2, 0xc1, op->cmp);
+    bjit_rax(a, 0x3ff0000000000000ull);
+    BJIT(a, 0x66, 0x48, 0x0f, 0x6e, 0xc8);
+    BJIT(a, 0x66, 0x0f, 0x54, 0xc1);
+    return 1;
+  }
+
+  // anything else must be a call to the lambda itself
+  if (j->self && j->self->sym != head->sym) return 0;
+  if (v->count - 1 != j->nformals) return 0;
+  j->self = head;
+
+  for (int i = 1; i < v->count; i++) {
+    if (!bjit_expr(a, v->cell[i], slot + i - 1)) return 0;
+    bjit_slot(a, 1, 0, slot + i - 1);
+  }
+
+  if (tail) {
+    for (int i = 0; i < j->nformals; i++) {
+      bjit_slot(a, 0, 0, slot + i);
+      bjit_formal(a, 1, i);
+    }
+    BJIT(a, 0xe9);
+    bjit_u32(a, a->body - (a->len + 4));
+    return 1;
+  }
+
+  // lea rdi, [rsp + 8 slot]; call the top; leave if that bailed
+  BJIT(a, 0x48, 0x8d, 0xbc, 0x24);
+  bjit_u32(a, 8 * slot);
+  BJIT(a, 0xe8);
+  bjit_u32(a, 0 - (a->len + 4));
+  bjit_rax(a, (uintptr_t) &bjit_bailed);
+  BJIT(a, 0x80, 0x38, 0x00);
+  bjit_exit(a, 0x85);
+  return 1;
+}
+
+
+/**
+ * Compile the body of a lambda with the given formals, attaching the
+ * result (or bjit_none) to the body's code
+ */
+void bjit_compile(bval* formals, bval* body) {
+  if (!body->code || body->code->jit) return;
+  body->code->jit = &bjit_none;
+  if (!(formals->flags & BVAL_F_PLAIN)) return;
+
+  bjit* j = calloc(1, sizeof(bjit));
+  j->nformals = formals->count;
+  j->formals = malloc(sizeof(char*) * (formals->count + 1));
+  for (int i = 0; i < formals->count; i++) {
+    j->formals[i] = formals->cell[i]->sym;
+  }
+
+  bjit_asm a = { NULL, 0, 0, 0, 0, NULL, 0, 0, j, 0 };
+
+  // push rbp; mov rbp, rsp; push rbx; sub rsp, frame; mov rbx, rdi
+  BJIT(&a, 0x55, 0x48, 0x89, 0xe5, 0x53, 0x48, 0x81, 0xec);
+  int frame = a.len;
+  bjit_u32(&a, 0);
+  BJIT(&a, 0x48, 0x89, 0xfb);
+
+  // bail when below the stack limit
+  bjit_rax(&a, (uintptr_t) &bjit_limit);
+  BJIT(&a, 0x48, 0x3b, 0x20);
+  int deep = bjit_jump(&a, 0x82);
+
+  a.body = a.len;
+  int ok = bjit_sexpr(&a, body, 0, 1);
+
+  // a formal must not hide a name the code relies on
+  for (int i = 0; ok && i < j->nformals; i++) {
+    if (j->self && j->self->sym == j->formals[i]) ok = 0;
+    for (int k = 0; k < j->nguards; k++) {
+      if (j->guards[k]->sym == j->formals[i]) ok = 0;
+    }
+  }
+
+  if (ok) {
+    int done = bjit_jump(&a, 0);
+    bjit_patch(&a, deep, a.len);
+    bjit_bail(&a, 2);
+    bjit_patch(&a, done, a.len);
+    for (int i = 0; i < a.nexits; i++) bjit_patch(&a, a.exits[i], a.len);
+
+    // lea rsp, [rbp - 8]; pop rbx; pop rbp; ret
+    BJIT(&a, 0x48, 0x8d, 0x65, 0xf8, 0x5b, 0x5d, 0xc3);
+
+    // keep rsp 16 byte aligned at calls
+    uint32_t size = 8 * a.slots;
+    if (size % 16 == 0) size += 8;
+    memcpy(a.code + frame, &size, 4);
+
+    j->size = a.len;
+    void* mem = mmap(NULL, j->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem != MAP_FAILED) {
+      memcpy(mem, a.code, a.len);
+
+      // where code can't be made executable the body stays on bjit_none
+      if (mprotect(mem, j->size, PROT_READ | PROT_EXEC) == 0) {
+        j->fn = (bjit_fn) mem;
+        body->code->jit = j;
+      } else {
+        munmap(mem, j->size);
+      }
+    }
+  }
+
+  free(a.code);
+  free(a.exits);
+  if (body->code->jit != j) bjit_free(j);
+}
+
+
+/**
+ * Run body as machine code in frame e if its assumptions hold there,
+ * returning NULL to have the interpreter run it otherwise
+ */
+bval* bjit_run(bjit* j, benv* e, bval* body) {
+  if (!j->fn) return NULL;
+
+  double args[j->nformals + 1];
+  for (int i = 0; i < j->nformals; i++) {
+    int k = benv_find(e, j->formals[i]);
+    if (k < 0 || BVAL_TYPE(e->vals[k]) != BVAL_NUM) return NULL;
+    args[i] = bval_number(e->vals[k]);
+  }
+
+  int ok = 1;
+  for (int i = 0; ok && i < j->nguards; i++) {
+    bval* x = benv_get(e, j->guards[i]);
+    ok = BVAL_TYPE(x) == BVAL_FUN && BVAL_IS_BUILTIN(x)
+      && x->builtin == j->builtins[i];
+    bval_del(x);
+  }
+
+  if (ok && j->self) {
+    bval* x = benv_get(e, j->self);
+    ok = BVAL_TYPE(x) == BVAL_FUN && !BVAL_IS_BUILTIN(x)
+      && x->body == body && x->env->count == 0
+      && x->formals->count == j->nformals;
+    for (int i = 0; ok && i < j->nformals; i++) {
+      ok = x->formals->cell[i]->sym == j->formals[i];
+    }
+    bval_del(x);
+  }
+  if (!ok) return NULL;
+
+  char here;
+  if (bjit_floor) {
+    if ((uintptr_t) &here < bjit_floor) return NULL;
+    bjit_floor = 0;
+  }
+  bjit_bailed = 0;
+  bjit_limit = (uintptr_t) &here - BJIT_STACK;
+
+  double r = j->fn(args);
+  if (bjit_bailed == 2) bjit_floor = (uintptr_t) &here;
+  return bjit_bailed ? NULL : bval_num(r);
+}
+
+
+void bjit_free(bjit* j) {
+  if (j == &bjit_none) return;
+  if (j->fn) munmap((void*) j->fn, j->size);
+  free(j->formals);
+  free(j->guards);
+  free(j->builtins);
+  free(j);
+}
+
+#else
+
+// no machine code on this platform, every body is interpreted
+void bjit_compile(bval* formals, bval* body) {}
+bval* bjit_run(bjit* j, benv* e, bval* body) { return NULL; }
+void bjit_free(bjit* j) {}
+
+#endif
@@ -1,7 +1,17 @@
 #include "blisp.h"
+#include "bpool.c"
+#include "bvec.c"
+#include "bsym.c"
+#include "bgc.c"
 #include "bval.c"
 #include "benv.c"
 #include "builtins.c"
+#include "bvm.c"
+#include "bclo.c"
+#include "bopt.c"
+#include "bmac.c"
+#include "bseq.c"
+#include "bjit.c"
 
 
 // embedded parser
@@ -9,11 +19,16 @@ void eval_blisp(benv* e, char* code) {
   mpc_result_t r;
 
   if (mpc_parse("<stdin>", code, Blisp, &r)) {
+    // the form's temporaries all live in the nursery
+    barena_enter(&bval_arena);
+
     // print the AST if valid
-    bval* v = bval_eval(e, bval_read(r.output));
+    bval* v = bval_eval(e, bmac_expand(bval_read(r.output), 0, NULL));
 
     bval_println(v);
     bval_del(v);
+    barena_leave(&bval_arena);
+    bgc_safepoint(e);
 
     mpc_ast_delete(r.output);
   } else {
@@ -23,7 +38,49 @@ void eval_blisp(benv* e, char* code) {
 }
 
 
-int main(int argc, char** argv) {
+// runtime switches, returns 0 for an unknown option
+int blisp_option(char* opt) {
+  if (strcmp(opt, "--no-vm") == 0) {
+    bvm_enabled = 0;
+    return 1;
+  }
+  if (strcmp(opt, "--jit") == 0) {
+    bjit_enabled = 1;
+    return 1;
+  }
+  if (strcmp(opt, "--closures") == 0) {
+    bvm_enabled = 0;
+    bclo_enabled = 1;
+    return 1;
+  }
+  if (strcmp(opt, "--no-opt") == 0) {
+    bopt_enabled = 0;
+    return 1;
+  }
+  if (strcmp(opt, "--dump-opt") == 0) {
+    bopt_dump = 1;
+    return 1;
+  }
+  if (strcmp(opt, "--gc-log") == 0) {
+    bval_gc.hook = blisp_gc_log;
+    return 1;
+  }
+  return 0;
+}
+
+
+// --gc-log: a line on stderr after each collection, with the totals so far
+void blisp_gc_log(bgc* gc) {
+  fprintf(stderr, "gc %ld: %ld live, %ld freed, %.3f ms paused, form depth %i\n",
+    gc->collections, bval_pool.live, gc->freed, gc->pause_total,
+    bval_arena.depth);
+}
+
+
+/**
+ * Set up the parsers, symbols and the global scope, which is returned
+ */
+benv* blisp_init(void) {
 
   // create Parsers
   Comment   = mpc_new("comment");
@@ -53,21 +110,56 @@ int main(int argc, char** argv) {
     ",
     Comment, Number, Symbol, String, Sexpr,  Qexpr, Expr, Blisp);
 
+  bsym_init();
+
   benv* e = benv_new();
+  benv_root = e;
   benv_add_builtins(e);
+  return e;
+}
+
+
+void blisp_release(benv* e) {
+  benv_del(e);
+  bpool_release(&bval_pool);
+  bpool_release(&benv_pool);
+  benv_release_builtins();
+  barena_release(&bval_arena);
+  bsym_release(&bval_syms);
+
+  // delete parsers
+  mpc_cleanup(8, Comment, Number, Symbol, String, Sexpr, Qexpr, Expr, Blisp);
+}
+
+
+// programs compiled by blispc bring their own main
+#ifndef BLISP_NO_MAIN
+int main(int argc, char** argv) {
+
+  // options come before the files to run
+  int files = 1;
+  while (files < argc && strncmp(argv[files], "--", 2) == 0) {
+    if (!blisp_option(argv[files])) {
+      fprintf(stderr, "unknown option '%s'\n", argv[files]);
+      return 1;
+    }
+    files++;
+  }
+
+  benv* e = blisp_init();
 
   // eval passed files
-  if (argc >= 2) {
-    for (int i = 1; i < argc; i++) {
+  if (files < argc) {
+    for (int i = files; i < argc; i++) {
 
       bval* args = bval_add(
         bval_sexpr(),
         bval_str(argv[i])
       );
 
-      bval* x = builtin_load(e, args);
+      bval* x = bval_apply(e, builtin_load, args);
 
-      if (x->type == BVAL_ERR) bval_println(x);
+      if (BVAL_TYPE(x) == BVAL_ERR) bval_println(x);
       bval_del(x);
     }
   } else {
@@ -88,9 +180,7 @@ int main(int argc, char** argv) {
     }
   }
 
-  benv_del(e);
-
-  // delete parsers
-  mpc_cleanup(8, Comment, Number, Symbol, String, Sexpr, Qexpr, Expr, Blisp);
+  blisp_release(e);
   return 0;
 }
+#endif
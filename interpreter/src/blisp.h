@@ -1,38 +1,45 @@
+// mmap flags, for the JIT's code buffers
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <math.h>
 #include <editline/readline.h>
 #include "../lib/mpc.h"
 
+// machine code for numeric lambdas, see bjit.c
+#if defined(__x86_64__) && defined(__unix__)
+#define BJIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
 
 
-#define ASSERT(arg, cond, fmt, ...) \
+// checks on the arguments of a builtin, which only borrows them
+#define ASSERT(cond, fmt, ...) \
   if (!(cond)) { \
-    bval* err = bval_err(fmt, ##__VA_ARGS__); \
-    bval_del(arg); \
-    return err; \
+    return bval_err(fmt, ##__VA_ARGS__); \
   }
 
-#define ASSERT_ARG_TYPE(a, index, arg_type, name) \
-  ASSERT(a, a->cell[index]->type == arg_type, \
+#define ASSERT_ARG_TYPE(argv, index, arg_type, name) \
+  ASSERT(BVAL_TYPE(argv[index]) == arg_type, \
     "Function '%s' needs type %s as argument %i, given type %s!", \
     name, \
     btype_name(arg_type), \
     index, \
-    btype_name(a->cell[index]->type));
-
-#define ASSERT_ARG_LEN(a, len, name) \
-  ASSERT(a, a->count == len, \
-    "Function '%s' given %i arguments, expected %i", \
-    name, a->count, len);
+    btype_name(BVAL_TYPE(argv[index])));
 
 // check for non-empty string or Q-expr
-#define ASSERT_NOT_EMPTY(a, name) \
-  ASSERT(a, ( \
-      ((a->cell[0]->type == BVAL_QEXPR) && (a->cell[0]->count != 0)) || \
-      ((a->cell[0]->type == BVAL_STR) && (a->cell[0]->str[0] != '\0')) \
+#define ASSERT_NOT_EMPTY(argv, name) \
+  ASSERT(( \
+      ((BVAL_TYPE(argv[0]) == BVAL_QEXPR) && (argv[0]->count != 0)) || \
+      ((BVAL_TYPE(argv[0]) == BVAL_STR) && (argv[0]->str[0] != '\0')) \
     ), \
     "Function '%s' passed empty %s!", \
-    name, btype_name(a->cell[0]->type));
+    name, btype_name(BVAL_TYPE(argv[0])));
 
 
 
@@ -41,33 +48,422 @@ struct benv;
 typedef struct bval bval;
 typedef struct benv benv;
 
-// builtin function pointer
-typedef bval*(*bbuiltin)(benv*, bval*);
+/**
+ * Builtin function pointer: the argc argument values in argv are borrowed
+ * from the caller, which releases them after the call. A builtin keeps a
+ * value by retaining it, or takes it over with bval_claim
+ */
+typedef bval*(*bbuiltin)(benv*, int, bval**);
+
+// old-style builtin, given its arguments as an S-expression it owns
+typedef bval*(*bbuiltin_sexpr)(benv*, bval*);
+
+// type masks for builtin arguments, 0 taking any type
+#define BTYPE(type) (1 << (type))
+
+// argument types given for each builtin, after which rest applies
+#define BBUILTIN_ARGS 3
+
+/**
+ * Builtin table entry (see builtin_table). Calls are checked against the
+ * arity and argument types before the builtin runs, so it only checks what
+ * they can't express. A pure builtin has no effects and a result depending
+ * only on its arguments, and op identifies the builtin without comparing
+ * names or function pointers
+ */
+typedef struct bbuiltin_info {
+  char* name;
+  bbuiltin fn;
+  int min;
+  int max; // -1 for any number of arguments
+  int args[BBUILTIN_ARGS];
+  int rest;
+  int pure;
+  int op;
+  bbuiltin_sexpr sexpr;
+  // given fewer arguments, returns a partial application (bval_partial)
+  int curry;
+  // the next entry made by benv_add_builtin_sexpr, which owns them
+  struct bbuiltin_info* next;
+} bbuiltin_info;
+
+// builtin opcodes
+enum {
+  BOP_NONE,
+  BOP_LIST, BOP_CONS, BOP_LEN, BOP_HEAD, BOP_TAIL, BOP_INIT, BOP_EVAL,
+  BOP_JOIN,
+  BOP_DEF, BOP_VAR, BOP_ENV, BOP_SIZEOF, BOP_GC, BOP_LAMBDA, BOP_MACRO,
+  BOP_TYPE,
+  BOP_LOAD, BOP_READ, BOP_PRINT, BOP_SHOW, BOP_ERROR, BOP_EXIT, BOP_FREAD,
+  BOP_FWRITE, BOP_STRING,
+  BOP_ADD, BOP_SUB, BOP_MUL, BOP_DIV, BOP_MOD, BOP_NOT,
+  BOP_IF, BOP_LT, BOP_GT, BOP_LE, BOP_GE, BOP_EQ, BOP_NE,
+  BOP_NTH, BOP_LAST, BOP_TAKE, BOP_DROP, BOP_MAP, BOP_FOLDL, BOP_SUM,
+  BOP_PRODUCT, BOP_JOINS,
+  BOP_RANGE, BOP_FILTER, BOP_TAKE_WHILE, BOP_FORCE, BOP_SEQ
+};
 
 // environment
 struct benv {
   benv* parent;
   int count;
+
+  // created while a form was running, so it may hold nursery values
+  int young;
+
+  // interned names, compared by pointer; large scopes keep their hash
+  // index right after the names (see benv_index)
   char** syms;
   bval** vals;
 };
 
-// blisp value
-struct bval {
-  int type;
+// scopes with more entries than this are hash indexed
+#ifndef BENV_INDEX_MIN
+#define BENV_INDEX_MIN 16
+#endif
+
+// slab of pool nodes, followed by the nodes themselves
+typedef struct bslab {
+  struct bslab* next;
+} bslab;
+
+// header in front of each node with -DBLISP_MALLOC, linking the live nodes
+typedef struct bpool_node {
+  struct bpool_node* prev;
+  struct bpool_node* next;
+} bpool_node;
+
+// fixed size node pool
+typedef struct bpool {
+  size_t size;
+  void* free;
+  bslab* slabs;
+  long live;
+  // the live nodes, with -DBLISP_MALLOC
+  bpool_node* nodes;
+} bpool;
+
+// walk over the live nodes of a pool, see bpool_next
+typedef struct bpool_iter {
+  bpool* pool;
+  bslab* slab;
+  char* node;
+  bpool_node* next;
+} bpool_iter;
+
+#define BPOOL_SLAB_SIZE (64 * 1024)
+
+// round node sizes up so every node in a slab stays aligned
+#define BPOOL_ALIGN 16
+#define BPOOL_CLASS(size) (((size) + BPOOL_ALIGN - 1) & ~((size_t) BPOOL_ALIGN - 1))
+#define BPOOL_SLAB_START(slab) ((char*) (slab) + BPOOL_CLASS(sizeof(bslab)))
+
+// first byte of a free pool node, and its free list link
+#define BPOOL_FREE 0xFF
+#define BPOOL_LINK(node) (((void**) (node))[1])
+
+// size of the header in front of a node with -DBLISP_MALLOC
+#define BPOOL_NODE_SIZE BPOOL_CLASS(sizeof(bpool_node))
+
+// payload block size classes: 16 bytes up to BMEM_MAX, header included
+#define BMEM_MIN 16
+#define BMEM_CLASSES 6
+#define BMEM_MAX (BMEM_MIN << (BMEM_CLASSES - 1))
+#define BMEM_HEAP 0xFF
+
+// header in front of every payload block
+typedef struct bmem_header {
+  unsigned int class;
+  unsigned int size;
+} bmem_header;
+
+// nursery: bump allocated young generation for the temporaries of the
+// running top-level form
+typedef struct barena {
+  size_t size;
+  bslab* first;
+  bslab* chunk;
+  char* top;
+  char* end;
+
+  // recycled nodes and payload blocks
+  void* free;
+  void* blocks[BMEM_CLASSES];
+
+  int depth;
+  int paused;
+
+  // minor collections so far
+  long minor;
+} barena;
+
+// elements of Q/S-expressions, shared between the expressions viewing a
+// slice of them (see bvec.c). Holds a reference to each of cell[front] up
+// to cell[back]
+typedef struct bvec {
+  int rc;
+  int front;
+  int back;
+  int cap;
+  // reached during the current collection
+  int mark;
+  int young;
+  bval* cell[];
+} bvec;
+
+// block holding the elements of Q/S-expression v, whose cell is not NULL
+#define BVEC(v) \
+  ((bvec*) ((char*) ((v)->cell - (v)->start) - offsetof(bvec, cell)))
+
+// formals of the lambdas enclosing a body being resolved or expanded,
+// innermost first
+typedef struct bscope {
+  bval* formals;
+  struct bscope* outer;
+} bscope;
+
+// closure compiled expression, see bclo.c
+struct bnode;
+typedef struct btail btail;
+typedef bval*(*bnode_fn)(struct bnode*, benv*, btail*);
+
+// lambda body compiled ahead of time to a C function, see blispc.c
+typedef bval*(*bnative)(benv*, bval*, btail*);
+
+typedef struct bnode {
+  bnode_fn run;
+  bval* v;
   int count;
+  struct bnode** kids;
+} bnode;
 
-  char* err;
-  char* sym;
-  char* str;
-  double num;
+// closure compiler state, nodes is NULL while sizing the tree
+typedef struct bclo_comp {
+  bnode* nodes;
+  bnode** kids;
+  int nnodes;
+  int nkids;
+} bclo_comp;
 
+// builtin operator with a node function of its own
+typedef struct bclo_op {
+  char* name;
   bbuiltin builtin;
-  benv* env;
-  bval* formals;
+  bnode_fn run;
+} bclo_op;
+
+// value of a folded S-expression, with the symbols it was computed from
+// and the versions of their root bindings at the time (see bopt.c)
+typedef struct bfold {
+  bval* value;
+  int count;
+  char** syms;
+  int* versions;
+  int cap;
+} bfold;
+
+// compiled lambda body: instructions and the constants they refer to,
+// which belong to the body the code was compiled from, or the node tree
+// when running with the closure tier, or a native function. A folded
+// S-expression has only the fold
+typedef struct bcode {
+  int count;
+  int depth;
+  int* ops;
+  bval** consts;
+  bnode* tree;
+  bnative native;
+  struct bjit* jit;
+  bfold* fold;
+} bcode;
+
+// body compiler state
+typedef struct bcomp {
+  int* ops;
+  int count;
+  int cap;
+  bval** consts;
+  int nconsts;
+  int cap_consts;
+  int depth;
+  int max_depth;
+} bcomp;
+
+// a call in tail position, handed back by bvm_run for bvm_exec to run:
+// the body to continue with and, for a lambda, the callee's frame
+struct btail {
+  benv* frame;
   bval* body;
+};
 
-  struct bval** cell;
+// VM instructions, operands follow the opcode
+enum {
+  BVM_CONST,  // k: push constant k
+  BVM_LOOKUP, // k: push the value of symbol constant k
+  BVM_APPLY,  // n: evaluate an S-expression of the top n values
+  BVM_TAIL,   // n: as BVM_APPLY, for the call giving the body its value
+  BVM_IF,     // else, generic: inline if, see bvm_compile_sexpr
+  BVM_JUMP,   // target
+  BVM_FOLD,   // k, end: push folded S-expression k and jump, if it holds
+  BVM_MACRO,  // k, tail, end: rewrite call k if its head is a macro, see bmac.c
+  BVM_RETURN
+};
+
+// machine code for a numeric lambda body: the formals it reads from the
+// frame, the symbols it needs to name given builtins, and the name it
+// calls itself by (see bjit_run)
+typedef double (*bjit_fn)(double*);
+
+typedef struct bjit {
+  bjit_fn fn;
+  size_t size;
+  int nformals;
+  char** formals;
+  int nguards;
+  bval** guards;
+  bbuiltin* builtins;
+  bval* self;
+} bjit;
+
+// machine code being assembled, with the deepest spill slot used, where
+// the body starts and the jumps to the epilogue still to be patched
+typedef struct bjit_asm {
+  unsigned char* code;
+  int len;
+  int cap;
+  int slots;
+  int body;
+  int* exits;
+  int nexits;
+  int cap_exits;
+  bjit* jit;
+  int cap_guards;
+} bjit_asm;
+
+typedef struct bjit_op {
+  char* name;
+  bbuiltin builtin;
+  unsigned char code;
+  int cmp;
+  int swap;
+} bjit_op;
+
+// interned symbol name and what the environments know about it
+typedef struct bsym {
+  // bindings of the name in live scopes other than the root
+  int shadows;
+  // slot of the name in the root scope, -1 if not defined there
+  int global;
+  // times the root binding has been replaced
+  int version;
+  char name[];
+} bsym;
+
+#define BSYM(sym) ((bsym*) ((sym) - offsetof(bsym, name)))
+
+// intern table for symbol names
+typedef struct bsymtab {
+  char** slots;
+  int count;
+  int cap;
+} bsymtab;
+
+// tracing collector: evaluator stack roots and statistics
+typedef struct bgc {
+  bval** roots;
+  int count;
+  int cap;
+
+  // live pool nodes that trigger the next collection
+  long threshold;
+  int requested;
+
+  long collections;
+  long freed;
+  double pause_total;
+  double pause_max;
+
+  // called after every collection
+  void (*hook)(struct bgc* gc);
+} bgc;
+
+#ifndef BGC_MIN_THRESHOLD
+#define BGC_MIN_THRESHOLD (64 * 1024)
+#endif
+
+// blisp value: a type tag plus one payload per type
+struct bval {
+  unsigned char type;
+  unsigned char flags;
+  // what a lazy sequence is made of (see bseq.c)
+  unsigned char kind;
+
+  // references held to this node; values are shared, never mutated while
+  // rc > 1 (see bval_own)
+  int rc;
+
+  union {
+#ifdef BLISP_BOXED_NUMS
+    double num;
+#endif
+    char* err;
+
+    // string: its characters, which are those of string base from some
+    // point on when it is a view of base (see bval_substr), else its own
+    struct {
+      char* str;
+      bval* base;
+    };
+
+    // symbol: interned name (see bsym_intern) and the scope and slot it
+    // was last resolved to, slot -1 if unresolved (see bval_resolve), and
+    // when it names a root constant, the fold of its value (see bopt_const)
+    struct {
+      char* sym;
+      int depth;
+      int slot;
+      struct bcode* inlined;
+    };
+
+    // Q/S-expression children, element start on of their block (see
+    // bvec.c), and the compiled form of a Q-expression used as a lambda
+    // body (see bvm_compile)
+    struct {
+      int count;
+      int start;
+      struct bval** cell;
+      struct bcode* code;
+    };
+
+    // builtin function (BVAL_F_BUILTIN set) and its table entry
+    struct {
+      bbuiltin builtin;
+      bbuiltin_info* info;
+    };
+
+    // lambda
+    struct {
+      benv* env;
+      bval* formals;
+      bval* body;
+    };
+
+    // lazy sequence: a range of numbers
+    struct {
+      double from;
+      double to;
+      double step;
+    };
+
+    // lazy sequence: the elements of src passed through fn, or for take
+    // (fn NULL) the next left of them, or from Q-expression src (fn NULL)
+    // its elements from index left on
+    struct {
+      bval* src;
+      bval* fn;
+      long left;
+    };
+  };
 };
 
 // bval types
@@ -79,9 +475,70 @@ enum {
   BVAL_FUN,
   BVAL_SYM,
   BVAL_STR,
-  BVAL_OK
+  BVAL_OK,
+  BVAL_SEQ
 };
 
+// kinds of lazy sequence
+enum {
+  BSEQ_RANGE,
+  BSEQ_LIST,
+  BSEQ_MAP,
+  BSEQ_FILTER,
+  BSEQ_TAKE_WHILE,
+  BSEQ_TAKE
+};
+
+// bval flags
+enum {
+  BVAL_F_BUILTIN = 1 << 0,
+  BVAL_F_ARENA   = 1 << 1,
+  BVAL_F_MARK    = 1 << 2,
+  // lambda body that has been through bval_resolve
+  BVAL_F_RESOLVED = 1 << 3,
+  // lambda formals that are distinct symbols, without '::'
+  BVAL_F_PLAIN    = 1 << 4,
+  // lambda that is a macro, see bmac.c
+  BVAL_F_MACRO    = 1 << 5
+};
+
+#define BVAL_IS_BUILTIN(v) ((v)->flags & BVAL_F_BUILTIN)
+#define BVAL_IS_YOUNG(v) ((v)->flags & BVAL_F_ARENA)
+
+
+/**
+ * Immediate values
+ *
+ * Numbers and ok! are encoded directly in the bval* handle instead of being
+ * allocated (NaN-boxing). A number handle is the bit pattern of the double
+ * offset by 2^48, so its top 16 bits are never zero, while heap pointers on
+ * 64 bit targets always have them clear. Immediates are never dereferenced:
+ * read their type with BVAL_TYPE and their value with bval_number.
+ *
+ * Building with -DBLISP_BOXED_NUMS (implied on 32 bit targets) keeps numbers
+ * on the heap, which is useful when chasing memory errors.
+ */
+#if UINTPTR_MAX != UINT64_MAX && !defined(BLISP_BOXED_NUMS)
+#define BLISP_BOXED_NUMS
+#endif
+
+#define BVAL_OK_HANDLE ((bval*) (uintptr_t) 0x6)
+
+#ifdef BLISP_BOXED_NUMS
+#define BVAL_IS_NUM(v) ((v) != BVAL_OK_HANDLE && (v)->type == BVAL_NUM)
+#define BVAL_IS_IMM(v) ((v) == BVAL_OK_HANDLE)
+#else
+#define BVAL_NUM_OFFSET ((uint64_t) 1 << 48)
+#define BVAL_IS_NUM(v) ((((uint64_t) (uintptr_t) (v)) >> 48) != 0)
+#define BVAL_IS_IMM(v) (BVAL_IS_NUM(v) || (v) == BVAL_OK_HANDLE)
+#endif
+
+#define BVAL_TYPE(v) ( \
+    BVAL_IS_NUM(v) ? BVAL_NUM : \
+    (v) == BVAL_OK_HANDLE ? BVAL_OK : \
+    (v)->type \
+  )
+
 mpc_parser_t* Comment;
 mpc_parser_t* Number;
 mpc_parser_t* Symbol;
@@ -91,32 +548,253 @@ mpc_parser_t* Qexpr;
 mpc_parser_t* Expr;
 mpc_parser_t* Blisp;
 
+// run lambda bodies as bytecode, --no-vm switches back to the tree walker
+extern int bvm_enabled;
+
+// run lambda bodies as closure trees instead, set by --closures
+extern int bclo_enabled;
+extern bclo_op bclo_ops[];
+
+// compile numeric lambdas to machine code too, set by --jit
+extern int bjit_enabled;
+extern bjit bjit_none;
+
+// fold constant expressions in loaded code, --no-opt turns it off and
+// --dump-opt prints the folded forms
+extern int bopt_enabled;
+extern int bopt_dump;
+
+// every builtin, ending in an entry without a name
+extern bbuiltin_info builtin_table[];
+
+// the global scope
+extern benv* benv_root;
+extern bbuiltin_info* benv_sexpr_builtins;
+
 void eval_blisp(benv* e, char* code);
+int blisp_option(char* opt);
+void blisp_gc_log(bgc* gc);
+benv* blisp_init(void);
+void blisp_release(benv* e);
+
+void bpool_grow(bpool* p);
+void* bpool_alloc(bpool* p);
+void bpool_free(bpool* p, void* node);
+void bpool_release(bpool* p);
+void bpool_iter_start(bpool_iter* it, bpool* p);
+void* bpool_next(bpool_iter* it);
+
+unsigned int bsym_hash(char* name);
+void bsym_grow(bsymtab* t);
+char* bsym_intern(char* name);
+void bsym_init(void);
+void bsym_release(bsymtab* t);
+
+int benv_index_cap(int count);
+int benv_room(int count);
+int* benv_index(benv* e);
+void benv_index_add(benv* e, int i);
+void benv_index_build(benv* e);
+void benv_alloc_slots(benv* e);
+int benv_find(benv* e, char* sym);
+void benv_append(benv* e, char* sym, bval* v);
+void benv_splice(benv* frame, benv* caller);
+
+
+bcode* bvm_compile(bval* body);
+bcode* bvm_code(bval* body);
+void bvm_emit(bcomp* c, int op);
+int bvm_const(bcomp* c, bval* v);
+void bvm_push(bcomp* c, int n);
+int bvm_is_if(bval* v);
+void bvm_compile_expr(bcomp* c, bval* v);
+void bvm_compile_sexpr(bcomp* c, bval* v, int tail);
+void bvm_compile_call(bcomp* c, bval* v, int tail);
+benv* bvm_frame(bval* f, bval** args, int n);
+bval* bvm_call(benv* e, bval* f, bval** args, int n);
+bval* bvm_exec(benv* e, bval* body);
+bval* bvm_run(benv* e, bcode* code, btail* tail);
+void bvm_free(bcode* code);
+
+#ifdef BJIT_SUPPORTED
+extern char bjit_bailed;
+extern uintptr_t bjit_limit;
+extern uintptr_t bjit_floor;
+extern bjit_op bjit_ops[];
+void bjit_code(bjit_asm* a, unsigned char* bytes, int n);
+void bjit_u32(bjit_asm* a, uint32_t x);
+void bjit_u64(bjit_asm* a, uint64_t x);
+void bjit_rax(bjit_asm* a, uint64_t x);
+void bjit_num(bjit_asm* a, double d);
+void bjit_slot(bjit_asm* a, int store, int xmm, int k);
+void bjit_formal(bjit_asm* a, int store, int i);
+int bjit_jump(bjit_asm* a, unsigned char cc);
+void bjit_patch(bjit_asm* a, int at, int target);
+void bjit_exit(bjit_asm* a, unsigned char cc);
+void bjit_bail(bjit_asm* a, char why);
+void bjit_guard(bjit_asm* a, bval* sym, bbuiltin fn);
+int bjit_formal_index(bjit* j, char* sym);
+int bjit_expr(bjit_asm* a, bval* v, int slot);
+int bjit_sexpr(bjit_asm* a, bval* v, int slot, int tail);
+#endif
+void bjit_compile(bval* formals, bval* body);
+bval* bjit_run(bjit* j, benv* e, bval* body);
+void bjit_free(bjit* j);
+
+bval* bmac_macro(bval* v, bscope* scope);
+int bmac_op(bval* v, bscope* scope);
+int bmac_bound(bscope* scope, char* sym);
+int bmac_mentions(bval* v, char* sym);
+int bmac_is_code(int op, int i);
+bval* bmac_expand(bval* v, int code, bscope* scope);
+int bmac_rest(bval* formals);
+int bmac_arity(bval* formals, int argc);
+bval* bmac_subst(bval* t, bval* formals, int argc, bval** argv);
+int bmac_applies(bval* f, int argc);
+bval* bmac_rewrite(bval* f, bval* v);
+bval* bmac_call(benv* e, bval* f, int argc, bval** argv);
+bval* bmac_partial(bval* f, int argc, bval** argv);
+
+bval* bseq_next(benv* e, bval* s, bval** rest);
+bval* bseq_test(benv* e, bval* fn, bval* x, char* name, int* pass);
+bval* bseq_head(benv* e, bval* s);
+bval* bseq_tail(benv* e, bval* s);
+bval* bseq_len(benv* e, bval* s);
+bval* bseq_reduce(benv* e, bval* s, int op, bval* fn, bval* acc);
+int bseq_done(bval** stages, long* left, int depth);
+int bseq_feed(benv* e, bval** stages, long* left, int depth, int op,
+  bval* fn, bval** acc, bval* x);
+bval* bseq_step(benv* e, int op, bval* fn, bval* acc, bval* x);
+char* bseq_name(int kind);
+int bseq_parts(bval* v, bval** parts);
+bval* bseq_to_string(bval* v);
+
+void bopt_form(bval* form);
+bval* bopt_const(bval* v, bfold* deps);
+bval* bopt_global(char* sym);
+void bopt_inline(bval* v, bval* x);
+void bopt_dep(bfold* deps, char* sym);
+bval* bopt_fold(bval* v, bfold* deps);
+bcode* bopt_code(int young, bfold* f);
+int bopt_valid(bfold* f);
+bval* bopt_value(bval* v);
+void bopt_show(bval* v);
+
+bnode* bclo_node(bclo_comp* c, bnode_fn run, bval* v, int count);
+void bclo_kid(bnode* n, int i, bnode* kid);
+bnode* bclo_compile_expr(bclo_comp* c, bval* v);
+bnode* bclo_compile_sexpr(bclo_comp* c, bval* v);
+bnode* bclo_compile_call(bclo_comp* c, bval* v);
+bcode* bclo_compile(bval* body);
+bcode* bclo_code(bval* body);
+void bclo_native(bval* body, bnative fn);
+bval* bclo_exec(benv* e, bval* body);
+bval* bclo_call(benv* e, bval* f, bval** args, int n, btail* t);
+int bclo_kids(bnode* n, benv* e, bval** vals, btail* t, bval** r);
+bval* bclo_expand(benv* e, bval* f, bval* v, btail* t);
+bval* bclo_abort(bval** vals, int n);
+bval* bclo_const(bnode* n, benv* e, btail* t);
+bval* bclo_lookup(bnode* n, benv* e, btail* t);
+bval* bclo_empty(bnode* n, benv* e, btail* t);
+bval* bclo_apply(bnode* n, benv* e, btail* t);
+bval* bclo_single(bnode* n, benv* e, btail* t);
+bval* bclo_if(bnode* n, benv* e, btail* t);
+bval* bclo_fold(bnode* n, benv* e, btail* t);
+bval* bclo_add(bnode* n, benv* e, btail* t);
+bval* bclo_sub(bnode* n, benv* e, btail* t);
+bval* bclo_mul(bnode* n, benv* e, btail* t);
+bval* bclo_div(bnode* n, benv* e, btail* t);
+bval* bclo_lt(bnode* n, benv* e, btail* t);
+bval* bclo_gt(bnode* n, benv* e, btail* t);
+bval* bclo_le(bnode* n, benv* e, btail* t);
+bval* bclo_ge(bnode* n, benv* e, btail* t);
+bval* bclo_eq(bnode* n, benv* e, btail* t);
+bval* bclo_ne(bnode* n, benv* e, btail* t);
+bval* bclo_add_vals(benv* e, bval** v, btail* t);
+bval* bclo_sub_vals(benv* e, bval** v, btail* t);
+bval* bclo_mul_vals(benv* e, bval** v, btail* t);
+bval* bclo_div_vals(benv* e, bval** v, btail* t);
+bval* bclo_lt_vals(benv* e, bval** v, btail* t);
+bval* bclo_gt_vals(benv* e, bval** v, btail* t);
+bval* bclo_le_vals(benv* e, bval** v, btail* t);
+bval* bclo_ge_vals(benv* e, bval** v, btail* t);
+bval* bclo_eq_vals(benv* e, bval** v, btail* t);
+bval* bclo_ne_vals(benv* e, bval** v, btail* t);
+
+void bgc_push(bval* v);
+void bgc_pop(void);
+void bgc_mark(bval* v);
+void bgc_mark_vec(bvec* b);
+void bgc_mark_env(benv* e);
+void bgc_count(bval* v, int n);
+void bgc_ref(bval* v, int n);
+void bgc_mark_held(void);
+void bgc_unref(bval* v);
+void bgc_release(bval* v);
+void bgc_collect(benv* e);
+void bgc_safepoint(benv* e);
+
+void* barena_bump(barena* a, size_t size);
+void* barena_alloc(barena* a);
+void barena_free(barena* a, void* node);
+void barena_enter(barena* a);
+void barena_leave(barena* a);
+void barena_release(barena* a);
+
+void* bmem_alloc(int young, size_t size);
+void* bmem_realloc(int young, void* p, size_t size);
+void bmem_free(void* p);
+char* bmem_strdup(int young, char* s);
+
+bvec* bvec_new(int young, int cap);
+bvec* bvec_from(int young, bval** cell, int count, int before, int after);
+void bvec_release(bvec* b);
+void bvec_trim(bval* v);
+int bvec_owned(bval* v);
+void bval_view(bval* v, bvec* b, int start, int count);
+void bval_room(bval* v, int n);
+void bval_unshare(bval* v);
+void bval_clear(bval* v);
+bval* bval_slice(bval* v, int from, int to);
+bval* bval_prepend(bval* x, bval* v);
 
 benv* benv_new(void);
 bval* benv_get(benv* e, bval* k);
 benv* benv_copy(benv* e);
 void benv_put(benv* e, bval* k, bval* v);
 void benv_del(benv* e);
-void benv_add_builtin(benv* e, char* name, bbuiltin fn);
+void benv_add_builtin(benv* e, bbuiltin_info* info);
+void benv_add_builtin_sexpr(benv* e, char* name, bbuiltin_sexpr fn);
+void benv_release_builtins(void);
 void benv_add_builtins(benv* e);
 void benv_def(benv* e, bval* k, bval* v);
 void benv_print_level(benv* e, int show_builtins, int l);
 void benv_print(benv* e, int show_builtins);
 
+bval* bval_alloc(void);
+void bval_free(bval* v);
 bval* bval_num(double num);
+bval* bval_ok(void);
+double bval_number(bval* v);
 bval* bval_err(char* fmt, ...);
 bval* bval_sym(char* sym);
 bval* bval_str(char* str);
+bval* bval_substr(bval* s, int k);
 bval* bval_sexpr(void);
 bval* bval_qexpr(void);
-bval* bval_fun(bbuiltin fn, char* name);
+bval* bval_fun(bbuiltin_info* info);
 bval* bval_lambda(bval* formals, bval* body);
-bval* builtin_to_string(benv* e, bval* a);
+bval* bval_range(double from, double to, double step);
+bval* bval_seq(int kind, bval* src, bval* fn, long left);
+int bval_formal_slot(bval* formals, char* sym);
+int bval_is_lambda_literal(bval* v);
+void bval_resolve(bval* v, bscope* scope);
+bval* builtin_to_string(benv* e, int argc, bval** argv);
 
 bval* bval_read(mpc_ast_t* tree);
 bval* bval_read_num(mpc_ast_t* tree);
 bval* bval_read_str(mpc_ast_t* tree);
+int bval_read_child(mpc_ast_t* child);
 
 bval* bval_add(bval* parent, bval* child);
 bval* bval_eval(benv* e, bval* v);
@@ -124,8 +802,20 @@ bval* bval_take(bval* v, int i);
 bval* bval_pop(bval* v, int i);
 bval* bval_join(bval* x, bval* y);
 bval* bval_eval_sexpr(benv* e, bval* v);
-bval* bval_call(benv* e, bval* f, bval* a);
+bval* bval_tail_expr(bval* f, int argc, bval** argv);
+bval* bval_eval_frame(benv* e, bval* v, int owned);
+bval* bval_call(benv* e, bval* f, int argc, bval** argv);
+bval* bval_builtin(benv* e, bval* f, int argc, bval** argv);
+bval* bval_builtin_check(bbuiltin_info* b, int argc, bval** argv);
+bval* bval_claim(bval** argv, int i);
+bval* bval_apply(benv* e, bbuiltin fn, bval* a);
+void bval_release(int argc, bval** argv);
+benv* bval_bind(benv* e, bval* f, int argc, bval** argv, bval** r);
 bval* bval_copy(bval* v);
+bval* bval_retain(bval* v);
+bval* bval_own(bval* v);
+bval* bval_promote(bval* v);
+int bval_in_arena(bval* v);
 bval* bval_to_string(bval* v);
 bval* bval_expr_to_string(bval* v, char* open, char* close);
 
@@ -138,46 +828,72 @@ void bval_str_print(bval* v);
 
 char* btype_name(int type);
 
-bval* builtin_op(benv* e, bval* v, char* op);
-bval* builtin_ord(benv* e, bval* v, char* op);
-bval* builtin_def(benv* e, bval* a);
-bval* builtin_var(benv* e, bval* a);
-bval* builtin_lambda(benv* e, bval* a);
-bval* builtin_variable(benv* e, bval* a, char* fn);
-bval* builtin_cmp(benv* e, bval* a, char* op);
-bval* builtin_type(benv* e, bval* a);
-bval* builtin_print(benv* e, bval* a);
-bval* builtin_error(benv* e, bval* a);
-bval* bultin_load_file(benv* e, bval* a, char* op);
-bval* builtin_read(benv* e, bval* a);
-bval* builtin_load(benv* e, bval* a);
-bval* builtin_show(benv* e, bval* a);
-bval* builtin_exit(benv* e, bval* a);
-bval* builtin_fread(benv* e, bval* a);
-bval* builtin_fwrite(benv* e, bval* a);
-bval* builtin_env(benv* e, bval* a);
-
-
-bval* builtin_head(benv* e, bval* a);
-bval* builtin_tail(benv* e, bval* a);
-bval* builtin_eval(benv* e, bval* a);
-bval* builtin_join(benv* e, bval* a);
-bval* builtin_list(benv* e, bval* a);
-bval* builtin_cons(benv* e, bval* a);
-bval* builtin_init(benv* e, bval* a);
-bval* builtin_len(benv* e, bval* a);
-
-bval* builtin_add(benv* e, bval* a);
-bval* builtin_sub(benv* e, bval* a);
-bval* builtin_mul(benv* e, bval* a);
-bval* builtin_div(benv* e, bval* a);
-bval* builtin_mod(benv* e, bval* a);
-bval* builtin_not(benv* e, bval* a);
-
-bval* builtin_if(benv* e, bval* a);
-bval* builtin_lt(benv* e, bval* a);
-bval* builtin_gt(benv* e, bval* a);
-bval* builtin_le(benv* e, bval* a);
-bval* builtin_ge(benv* e, bval* a);
-bval* builtin_eq(benv* e, bval* a);
-bval* builtin_ne(benv* e, bval* a);
+bval* builtin_op(benv* e, int argc, bval** argv, int op);
+bval* builtin_ord(benv* e, int argc, bval** argv, int op);
+bval* builtin_def(benv* e, int argc, bval** argv);
+bval* builtin_var(benv* e, int argc, bval** argv);
+bval* builtin_lambda(benv* e, int argc, bval** argv);
+bval* builtin_macro(benv* e, int argc, bval** argv);
+bval* builtin_variable(benv* e, int argc, bval** argv, char* fn);
+bval* builtin_cmp(benv* e, int argc, bval** argv, int op);
+bval* builtin_type(benv* e, int argc, bval** argv);
+bval* builtin_print(benv* e, int argc, bval** argv);
+bval* builtin_error(benv* e, int argc, bval** argv);
+bval* bultin_load_file(benv* e, int argc, bval** argv, char* op);
+void builtin_load_form(benv* e, bval* form);
+bval* builtin_read(benv* e, int argc, bval** argv);
+bval* builtin_load(benv* e, int argc, bval** argv);
+bval* builtin_show(benv* e, int argc, bval** argv);
+bval* builtin_exit(benv* e, int argc, bval** argv);
+bval* builtin_fread(benv* e, int argc, bval** argv);
+bval* builtin_fwrite(benv* e, int argc, bval** argv);
+bval* builtin_env(benv* e, int argc, bval** argv);
+bval* builtin_sizeof(benv* e, int argc, bval** argv);
+bval* builtin_gc(benv* e, int argc, bval** argv);
+
+
+bval* builtin_head(benv* e, int argc, bval** argv);
+bval* builtin_tail(benv* e, int argc, bval** argv);
+bval* builtin_eval(benv* e, int argc, bval** argv);
+bval* builtin_join(benv* e, int argc, bval** argv);
+bval* builtin_list(benv* e, int argc, bval** argv);
+bval* builtin_cons(benv* e, int argc, bval** argv);
+bval* builtin_init(benv* e, int argc, bval** argv);
+bval* builtin_len(benv* e, int argc, bval** argv);
+
+bval* builtin_nth(benv* e, int argc, bval** argv);
+bval* builtin_nth_walk(benv* e, bval* n, bval* l);
+bval* builtin_first(benv* e, bval* l);
+bval* builtin_last(benv* e, int argc, bval** argv);
+int builtin_count(bval* n, bval* l);
+bval* builtin_take(benv* e, int argc, bval** argv);
+bval* builtin_drop(benv* e, int argc, bval** argv);
+bval* builtin_map(benv* e, int argc, bval** argv);
+bval* builtin_foldl(benv* e, int argc, bval** argv);
+bval* builtin_fold_op(benv* e, bval* l, int op, double start);
+bval* builtin_fold_name(benv* e, bval* l, char* name, int op, double start);
+bval* builtin_sum(benv* e, int argc, bval** argv);
+bval* builtin_product(benv* e, int argc, bval** argv);
+bval* builtin_joins(benv* e, int argc, bval** argv);
+bval* builtin_call(benv* e, int op, int argc, bval** argv);
+bval* builtin_range(benv* e, int argc, bval** argv);
+bval* builtin_filter(benv* e, int argc, bval** argv);
+bval* builtin_take_while(benv* e, int argc, bval** argv);
+bval* builtin_keep(benv* e, bval* f, bval* l, int kind);
+bval* builtin_force(benv* e, int argc, bval** argv);
+bval* builtin_seq(benv* e, int argc, bval** argv);
+
+bval* builtin_add(benv* e, int argc, bval** argv);
+bval* builtin_sub(benv* e, int argc, bval** argv);
+bval* builtin_mul(benv* e, int argc, bval** argv);
+bval* builtin_div(benv* e, int argc, bval** argv);
+bval* builtin_mod(benv* e, int argc, bval** argv);
+bval* builtin_not(benv* e, int argc, bval** argv);
+
+bval* builtin_if(benv* e, int argc, bval** argv);
+bval* builtin_lt(benv* e, int argc, bval** argv);
+bval* builtin_gt(benv* e, int argc, bval** argv);
+bval* builtin_le(benv* e, int argc, bval** argv);
+bval* builtin_ge(benv* e, int argc, bval** argv);
+bval* builtin_eq(benv* e, int argc, bval** argv);
+bval* builtin_ne(benv* e, int argc, bval** argv);
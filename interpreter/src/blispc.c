@@ -0,0 +1,625 @@
+/**
+ * blispc: ahead of time compiler from blisp to C
+ *
+ *   blispc prog.blisp -o prog        build the executable ./prog
+ *   blispc -S prog.blisp -o prog.c   only write the C
+ *
+ * A program, and every file it loads at the top level with a literal
+ * path (usually the prelude), becomes one C translation unit that includes
+ * this runtime and is built by cc. At startup the program's forms are
+ * constructed directly as values, skipping the parser, then evaluated in
+ * order just as load would.
+ *
+ * The macro calls in the forms are expanded as they are read, as load
+ * would expand them (see bmac.c). For that the top level definitions of
+ * macros, and of other names for builtins and macros such as fn, are run
+ * at compile time (blc_define); nothing else is.
+ *
+ * Every lambda body written in the source, the body of a \ or fn call
+ * once defn and the like are expanded, is compiled to a C function that
+ * runs in place of the body on the closure tier (see bclo_native). The
+ * function follows the node kinds of bclo.c in straight line C: variables
+ * are looked up, an inline if tests its condition directly, a head that
+ * turns out to be a macro is given the forms of its call (bclo_expand),
+ * the arithmetic and comparison operators go through bclo_*_vals and every
+ * other call is made with bclo_call, tail calls included. Bodies made at
+ * run time, and anything given to eval, run on the closure tier as usual;
+ * the interpreter stays the reference for what every form means.
+ *
+ * Calls are not bound to the C function of the defn they name. Scope is
+ * dynamic, so the function a name refers to is only known when the call
+ * is made: any caller may bind the name as a parameter, and def may
+ * replace the global at any time. So a call looks the name up as the
+ * interpreter would and goes through bclo_call, which binds the frame and
+ * runs the callee's compiled body when it has one; the C compiler never
+ * sees one body call another directly.
+ *
+ * cc is run as $CC (default cc) with $CFLAGS and $LDFLAGS, and the runtime
+ * is found in $BLISP_HOME, by default the interpreter directory blispc was
+ * built from.
+ */
+#define BLISP_NO_MAIN
+#include "blisp.c"
+
+#include <stdarg.h>
+
+#ifndef BLISP_HOME
+#define BLISP_HOME "."
+#endif
+
+
+// growable text buffer
+typedef struct blc_out {
+  char* buf;
+  size_t len;
+  size_t cap;
+} blc_out;
+
+// compiler state: the C written so far for bodies and forms, and the
+// deepest value stack slot used by the body being compiled
+typedef struct blc {
+  blc_out bodies;
+  blc_out forms;
+  int nbodies;
+  int nforms;
+  int slots;
+} blc;
+
+// operators with a function of their own, see BCLO_BINOP
+typedef struct blc_op {
+  char* name;
+  char* vals;
+} blc_op;
+
+blc_op blc_ops[] = {
+  { "+",  "bclo_add_vals" },
+  { "-",  "bclo_sub_vals" },
+  { "*",  "bclo_mul_vals" },
+  { "/",  "bclo_div_vals" },
+  { "<",  "bclo_lt_vals" },
+  { ">",  "bclo_gt_vals" },
+  { "<=", "bclo_le_vals" },
+  { ">=", "bclo_ge_vals" },
+  { "=",  "bclo_eq_vals" },
+  { "!=", "bclo_ne_vals" },
+  { NULL, NULL }
+};
+
+void blc_printf(blc_out* o, char* fmt, ...);
+void blc_indent(blc_out* o, int depth);
+void blc_string(blc_out* o, char* s);
+char* blc_quote(char* path, char* suffix);
+char* blc_path(char* path, int i);
+int blc_is_lambda(bval* v);
+int blc_pure(bval* v);
+void blc_define(bval* v);
+void blc_check(blc* c, blc_out* o, int slot, int tail, int depth);
+int blc_macro(blc* c, blc_out* o, bval* v, char* path, int slot, int tail,
+  int depth);
+void blc_slot(blc* c, int slot);
+void blc_expr(blc* c, blc_out* o, bval* v, char* path, int slot, int tail,
+  int depth);
+void blc_sexpr(blc* c, blc_out* o, bval* v, char* path, int slot, int tail,
+  int depth);
+int blc_body(blc* c, bval* body);
+void blc_build(blc* c, blc_out* o, bval* v, int d, int body);
+int blc_depth(bval* v);
+int blc_file(blc* c, char* file);
+
+
+void blc_printf(blc_out* o, char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int n = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+
+  if (o->len + n + 1 > o->cap) {
+    o->cap = (o->len + n + 1) * 2;
+    o->buf = realloc(o->buf, o->cap);
+  }
+
+  va_start(va, fmt);
+  vsnprintf(o->buf + o->len, n + 1, fmt, va);
+  va_end(va);
+  o->len += n;
+}
+
+
+void blc_indent(blc_out* o, int depth) {
+  blc_printf(o, "%*s", depth * 2, "");
+}
+
+
+// s as a C string literal
+void blc_string(blc_out* o, char* s) {
+  blc_printf(o, "\"");
+  for (; *s; s++) {
+    unsigned char ch = *s;
+    switch (ch) {
+      case '\\': blc_printf(o, "\\\\"); break;
+      case '"':  blc_printf(o, "\\\""); break;
+      case '\n': blc_printf(o, "\\n"); break;
+      case '\t': blc_printf(o, "\\t"); break;
+      case '\r': blc_printf(o, "\\r"); break;
+      default:
+        if (ch < ' ' || ch > '~') blc_printf(o, "\\%03o", ch);
+        else blc_printf(o, "%c", ch);
+    }
+  }
+  blc_printf(o, "\"");
+}
+
+
+// path followed by suffix as one single quoted shell word, to be freed
+char* blc_quote(char* path, char* suffix) {
+  char* q = malloc(4 * (strlen(path) + strlen(suffix)) + 3);
+  char* end = q;
+  *end++ = '\'';
+  for (int part = 0; part < 2; part++) {
+    for (char* s = part ? suffix : path; *s; s++) {
+      // a quote ends the word, is escaped and starts it again
+      if (*s == '\'') {
+        memcpy(end, "'\\''", 4);
+        end += 4;
+      } else {
+        *end++ = *s;
+      }
+    }
+  }
+  *end++ = '\'';
+  *end = '\0';
+  return q;
+}
+
+
+// C expression for child i of the value at path, to be freed
+char* blc_path(char* path, int i) {
+  char* p = malloc(strlen(path) + 24);
+  sprintf(p, "%s->cell[%i]", path, i);
+  return p;
+}
+
+
+// (\ formals {body}), with formals a literal or, as from defn, an
+// expression giving them
+int blc_is_lambda(bval* v) {
+  return BVAL_TYPE(v) == BVAL_SEXPR && v->count == 3
+    && BVAL_TYPE(v->cell[0]) == BVAL_SYM
+    && (v->cell[0]->sym == bsym_lambda || v->cell[0]->sym == bsym_fn)
+    && BVAL_TYPE(v->cell[2]) == BVAL_QEXPR;
+}
+
+
+// whether v only calls pure builtins when evaluated
+int blc_pure(bval* v) {
+  if (BVAL_TYPE(v) != BVAL_SEXPR) return 1;
+  if (v->count == 0 || BVAL_TYPE(v->cell[0]) != BVAL_SYM) return 0;
+
+  bval* f = bopt_global(v->cell[0]->sym);
+  if (!f || BVAL_TYPE(f) != BVAL_FUN || !BVAL_IS_BUILTIN(f) || !f->info->pure) {
+    return 0;
+  }
+  for (int i = 1; i < v->count; i++) {
+    if (!blc_pure(v->cell[i])) return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Run a top level definition of a macro, or of another name for a builtin
+ * or macro (as fn is for \), so the forms after it are expanded as load
+ * would expand them. Nothing else in the program runs at compile time
+ */
+void blc_define(bval* v) {
+  if (BVAL_TYPE(v) != BVAL_SEXPR || v->count != 3
+      || bmac_op(v->cell[0], NULL) != BOP_DEF || !blc_pure(v->cell[1])) {
+    return;
+  }
+
+  bval* x = v->cell[2];
+  bval* f = BVAL_TYPE(x) == BVAL_SYM ? bopt_global(x->sym) : NULL;
+  int alias = f && BVAL_TYPE(f) == BVAL_FUN
+    && (BVAL_IS_BUILTIN(f) || (f->flags & BVAL_F_MACRO));
+  int macro = BVAL_TYPE(x) == BVAL_SEXPR && x->count == 3
+    && bmac_op(x->cell[0], NULL) == BOP_MACRO && blc_pure(x->cell[1]);
+
+  if (alias || macro) builtin_load_form(benv_root, bval_copy(v));
+}
+
+
+void blc_slot(blc* c, int slot) {
+  if (slot + 1 > c->slots) c->slots = slot + 1;
+}
+
+
+// an error anywhere is the value of the whole body
+void blc_check(blc* c, blc_out* o, int slot, int tail, int depth) {
+  if (tail) return;
+  blc_indent(o, depth);
+  blc_printf(o, "if (BVAL_TYPE(s[%i]) == BVAL_ERR) return bclo_abort(s, %i);\n",
+    slot, slot);
+}
+
+
+// C leaving the value of v in s[slot], as bval_eval would give it
+void blc_expr(blc* c, blc_out* o, bval* v, char* path, int slot, int tail,
+    int depth) {
+  blc_slot(c, slot);
+
+  switch (BVAL_TYPE(v)) {
+    case BVAL_SYM:
+      blc_indent(o, depth);
+      blc_printf(o, "s[%i] = benv_get(e, %s);\n", slot, path);
+      blc_check(c, o, slot, tail, depth);
+      break;
+
+    case BVAL_SEXPR:
+      blc_sexpr(c, o, v, path, slot, tail, depth);
+      break;
+
+    default:
+      blc_indent(o, depth);
+      blc_printf(o, "s[%i] = bval_retain(%s);\n", slot, path);
+      if (BVAL_TYPE(v) == BVAL_ERR) blc_check(c, o, slot, tail, depth);
+  }
+}
+
+
+/**
+ * C checking whether the head of the call v, in s[slot], is a macro, which
+ * is given the forms of the call (see bclo_expand). Returns 1 if the check
+ * was written, leaving an else block open for the call itself
+ */
+int blc_macro(blc* c, blc_out* o, bval* v, char* path, int slot, int tail,
+    int depth) {
+  int head = BVAL_TYPE(v->cell[0]);
+  if (head != BVAL_SYM && head != BVAL_SEXPR) return 0;
+
+  blc_indent(o, depth);
+  blc_printf(o, "if (bmac_applies(s[%i], %i)) {\n", slot, v->count - 1);
+  blc_indent(o, depth + 1);
+  blc_printf(o, "s[%i] = bclo_expand(e, s[%i], %s, %s);\n", slot, slot, path,
+    tail ? "t" : "NULL");
+  blc_check(c, o, slot, tail, depth + 1);
+  blc_indent(o, depth);
+  blc_printf(o, "} else {\n");
+  return 1;
+}
+
+
+// C leaving the value of the elements of v evaluated as an S-expression in
+// s[slot]; in tail position a call may hand itself back through t instead
+void blc_sexpr(blc* c, blc_out* o, bval* v, char* path, int slot, int tail,
+    int depth) {
+  char* t = tail ? "t" : "NULL";
+  blc_slot(c, slot);
+
+  if (v->count == 0) {
+    blc_indent(o, depth);
+    blc_printf(o, "s[%i] = bval_sexpr();\n", slot);
+    return;
+  }
+
+  char* kids[v->count];
+  for (int i = 0; i < v->count; i++) kids[i] = blc_path(path, i);
+
+  // the head, unless it is the only element and can't be a macro
+  int macro = 0;
+  if (v->count > 1 || BVAL_TYPE(v->cell[0]) == BVAL_SYM
+      || BVAL_TYPE(v->cell[0]) == BVAL_SEXPR) {
+    blc_expr(c, o, v->cell[0], kids[0], slot, 0, depth);
+    macro = blc_macro(c, o, v, path, slot, tail, depth);
+    depth += macro;
+  }
+
+  if (v->count == 1) {
+    if (!macro) blc_expr(c, o, v->cell[0], kids[0], slot, tail, depth);
+
+  } else if (bvm_is_if(v)) {
+    int f = slot;
+    int cond = slot + 1;
+    blc_expr(c, o, v->cell[1], kids[1], cond, 0, depth);
+    blc_slot(c, slot + 3);
+
+    blc_indent(o, depth);
+    blc_printf(o,
+      "if (BVAL_TYPE(s[%i]) == BVAL_FUN && BVAL_IS_BUILTIN(s[%i])"
+      " && s[%i]->builtin == builtin_if && BVAL_TYPE(s[%i]) == BVAL_NUM) {\n",
+      f, f, f, cond);
+    blc_indent(o, depth + 1);
+    blc_printf(o, "int truthy = bval_number(s[%i]) != 0;\n", cond);
+    blc_indent(o, depth + 1);
+    blc_printf(o, "bval_del(s[%i]);\n", f);
+    blc_indent(o, depth + 1);
+    blc_printf(o, "bval_del(s[%i]);\n", cond);
+
+    blc_indent(o, depth + 1);
+    blc_printf(o, "if (truthy) {\n");
+    blc_sexpr(c, o, v->cell[2], kids[2], slot, tail, depth + 2);
+    blc_indent(o, depth + 1);
+    blc_printf(o, "} else {\n");
+    blc_sexpr(c, o, v->cell[3], kids[3], slot, tail, depth + 2);
+    blc_indent(o, depth + 1);
+    blc_printf(o, "}\n");
+
+    // generic call with the branches as data
+    blc_indent(o, depth);
+    blc_printf(o, "} else {\n");
+    blc_indent(o, depth + 1);
+    blc_printf(o, "s[%i] = bval_retain(%s);\n", slot + 2, kids[2]);
+    blc_indent(o, depth + 1);
+    blc_printf(o, "s[%i] = bval_retain(%s);\n", slot + 3, kids[3]);
+    blc_indent(o, depth + 1);
+    blc_printf(o, "s[%i] = bclo_call(e, s[%i], &s[%i], 3, %s);\n",
+      slot, slot, cond, t);
+    blc_check(c, o, slot, tail, depth + 1);
+    blc_indent(o, depth);
+    blc_printf(o, "}\n");
+
+  } else {
+    char* vals = NULL;
+    if (v->count == 3 && BVAL_TYPE(v->cell[0]) == BVAL_SYM) {
+      for (blc_op* op = blc_ops; op->name; op++) {
+        if (strcmp(v->cell[0]->sym, op->name) == 0) vals = op->vals;
+      }
+    }
+
+    for (int i = 1; i < v->count; i++) {
+      blc_expr(c, o, v->cell[i], kids[i], slot + i, 0, depth);
+    }
+
+    blc_indent(o, depth);
+    if (vals) {
+      blc_printf(o, "s[%i] = %s(e, &s[%i], %s);\n", slot, vals, slot, t);
+    } else {
+      blc_printf(o, "s[%i] = bclo_call(e, s[%i], &s[%i], %i, %s);\n",
+        slot, slot, slot + 1, v->count - 1, t);
+    }
+    blc_check(c, o, slot, tail, depth);
+  }
+
+  if (macro) {
+    blc_indent(o, depth - 1);
+    blc_printf(o, "}\n");
+  }
+  for (int i = 0; i < v->count; i++) free(kids[i]);
+}
+
+
+// compile a lambda body to a C function, returning its number
+int blc_body(blc* c, bval* body) {
+  int n = c->nbodies++;
+
+  blc_out code = { NULL, 0, 0 };
+  c->slots = 1;
+  blc_sexpr(c, &code, body, "body", 0, 1, 1);
+
+  blc_printf(&c->bodies, "bval* blc_body_%i(benv* e, bval* body, btail* t) {\n",
+    n);
+  blc_printf(&c->bodies, "  bval* s[%i];\n", c->slots);
+  blc_printf(&c->bodies, "%s", code.buf);
+  blc_printf(&c->bodies, "  return s[0];\n}\n\n");
+
+  free(code.buf);
+  return n;
+}
+
+
+/**
+ * C building v in x[d], with the body function numbered body attached when
+ * not -1. Lambda bodies found among the children are compiled on the way
+ */
+void blc_build(blc* c, blc_out* o, bval* v, int d, int body) {
+  blc_printf(o, "  x[%i] = ", d);
+
+  switch (BVAL_TYPE(v)) {
+    case BVAL_NUM: {
+      // a literal too large for a double reads as infinity, which %g
+      // would print as a name C doesn't know
+      double n = bval_number(v);
+      if (isnan(n)) {
+        blc_printf(o, "bval_num(NAN);\n");
+      } else if (isinf(n)) {
+        blc_printf(o, "bval_num(%sINFINITY);\n", n < 0 ? "-" : "");
+      } else {
+        blc_printf(o, "bval_num(%.17g);\n", n);
+      }
+      break;
+    }
+
+    case BVAL_SYM:
+      blc_printf(o, "bval_sym(");
+      blc_string(o, v->sym);
+      blc_printf(o, ");\n");
+      break;
+
+    case BVAL_STR:
+      blc_printf(o, "bval_str(");
+      blc_string(o, v->str);
+      blc_printf(o, ");\n");
+      break;
+
+    case BVAL_ERR:
+      blc_printf(o, "bval_err(\"%%s\", ");
+      blc_string(o, v->err);
+      blc_printf(o, ");\n");
+      break;
+
+    case BVAL_SEXPR:
+    case BVAL_QEXPR: {
+      blc_printf(o, BVAL_TYPE(v) == BVAL_SEXPR
+        ? "bval_sexpr();\n" : "bval_qexpr();\n");
+
+      int lambda = blc_is_lambda(v);
+      for (int i = 0; i < v->count; i++) {
+        int inner = lambda && i == 2 ? blc_body(c, v->cell[i]) : -1;
+        blc_build(c, o, v->cell[i], d + 1, inner);
+        blc_printf(o, "  bval_add(x[%i], x[%i]);\n", d, d + 1);
+      }
+
+      if (body >= 0) {
+        blc_printf(o, "  bclo_native(x[%i], blc_body_%i);\n", d, body);
+      }
+      break;
+    }
+
+    default:
+      blc_printf(o, "bval_ok();\n");
+  }
+}
+
+
+// depth of nesting below v, to size a form's build stack
+int blc_depth(bval* v) {
+  int type = BVAL_TYPE(v);
+  if (type != BVAL_SEXPR && type != BVAL_QEXPR) return 1;
+
+  int max = 0;
+  for (int i = 0; i < v->count; i++) {
+    int d = blc_depth(v->cell[i]);
+    if (d > max) max = d;
+  }
+  return max + 1;
+}
+
+
+/**
+ * Compile the forms of a file, following loads of literal paths at the
+ * top level. Returns 0 if the file could not be read
+ */
+int blc_file(blc* c, char* file) {
+  mpc_result_t r;
+
+  if (!mpc_parse_contents(file, Blisp, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+  }
+
+  bval* forms = bval_read(r.output);
+  mpc_ast_delete(r.output);
+
+  for (int i = 0; i < forms->count; i++) {
+    forms->cell[i] = bmac_expand(forms->cell[i], 0, NULL);
+    bval* v = forms->cell[i];
+
+    if (BVAL_TYPE(v) == BVAL_SEXPR && v->count == 2
+        && BVAL_TYPE(v->cell[0]) == BVAL_SYM
+        && strcmp(v->cell[0]->sym, "load") == 0
+        && BVAL_TYPE(v->cell[1]) == BVAL_STR) {
+      if (!blc_file(c, v->cell[1]->str)) {
+        bval_del(forms);
+        return 0;
+      }
+      continue;
+    }
+
+    blc_printf(&c->forms, "bval* blc_form_%i(void) {\n", c->nforms++);
+    blc_printf(&c->forms, "  bval* x[%i];\n", blc_depth(v));
+    blc_build(c, &c->forms, v, 0, -1);
+    blc_printf(&c->forms, "  return x[0];\n}\n\n");
+    blc_define(v);
+  }
+
+  bval_del(forms);
+  return 1;
+}
+
+
+int main(int argc, char** argv) {
+  char* input = NULL;
+  char* output = NULL;
+  int source_only = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-S") == 0) {
+      source_only = 1;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (!input && argv[i][0] != '-') {
+      input = argv[i];
+    } else {
+      input = NULL;
+      break;
+    }
+  }
+
+  if (!input || (!source_only && !output)) {
+    fprintf(stderr, "usage: blispc [-S] file.blisp -o output\n");
+    return 1;
+  }
+
+  benv* e = blisp_init();
+  blc c = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, 0 };
+  if (!blc_file(&c, input)) {
+    blisp_release(e);
+    return 1;
+  }
+
+  // the C source goes to output, or beside the executable
+  char* source = output;
+  if (!source_only) {
+    source = malloc(strlen(output) + 3);
+    sprintf(source, "%s.c", output);
+  }
+
+  FILE* f = source ? fopen(source, "w") : stdout;
+  if (!f) {
+    fprintf(stderr, "blispc: cannot write '%s'\n", source);
+    blisp_release(e);
+    return 1;
+  }
+
+  fprintf(f, "// compiled by blispc from %s\n", input);
+  fprintf(f, "#define BLISP_NO_MAIN\n#include \"blisp.c\"\n\n");
+  for (int i = 0; i < c.nbodies; i++) {
+    fprintf(f, "bval* blc_body_%i(benv* e, bval* body, btail* t);\n", i);
+  }
+  fprintf(f, "\n%s%s", c.bodies.buf ? c.bodies.buf : "",
+    c.forms.buf ? c.forms.buf : "");
+
+  // forms are built outside the nursery, as load builds them
+  fprintf(f, "int main(int argc, char** argv) {\n");
+  fprintf(f, "  benv* e = blisp_init();\n");
+  fprintf(f, "  bvm_enabled = 0;\n");
+  fprintf(f, "  bclo_enabled = 1;\n\n");
+  for (int i = 0; i < c.nforms; i++) {
+    fprintf(f, "  builtin_load_form(e, blc_form_%i());\n", i);
+  }
+  fprintf(f, "\n  blisp_release(e);\n  return 0;\n}\n");
+  if (f != stdout) fclose(f);
+
+  free(c.bodies.buf);
+  free(c.forms.buf);
+  blisp_release(e);
+  if (source_only) return 0;
+
+  char* home = getenv("BLISP_HOME") ? getenv("BLISP_HOME") : BLISP_HOME;
+  char* cc = getenv("CC") ? getenv("CC") : "cc";
+  char* cflags = getenv("CFLAGS") ? getenv("CFLAGS") : "";
+  char* ldflags = getenv("LDFLAGS") ? getenv("LDFLAGS") : "";
+
+  // paths are quoted for the shell, the flags are split by it as make
+  // would split them
+  char* src = blc_quote(home, "/src");
+  char* mpc = blc_quote(home, "/lib/mpc.c");
+  char* in = blc_quote(source, "");
+  char* out = blc_quote(output, "");
+
+  size_t size = strlen(cc) + strlen(cflags) + strlen(ldflags) + strlen(src)
+    + strlen(mpc) + strlen(in) + strlen(out) + 128;
+  char* cmd = malloc(size);
+  snprintf(cmd, size,
+    "%s -std=c11 -O2 %s -I%s %s %s -lm %s -o %s",
+    cc, cflags, src, in, mpc, ldflags, out);
+
+  int status = system(cmd);
+  free(cmd);
+  free(src);
+  free(mpc);
+  free(in);
+  free(out);
+  free(source);
+  return status == 0 ? 0 : 1;
+}
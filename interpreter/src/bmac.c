@@ -0,0 +1,255 @@
+/**
+ * Macros
+ *
+ * (macro {formals} {template}) makes a macro, and defmacro in the prelude
+ * names one as defn names a lambda. A call of a macro is replaced by the
+ * macro's template with each formal replaced by the form given for it,
+ * unevaluated, and the result is evaluated in its place. A formal after
+ * '::' takes the remaining forms, spliced in where it appears.
+ *
+ * Calls are rewritten once where possible, when the form they are in is
+ * loaded, typed at the REPL or compiled by blispc, and the rewritten form
+ * is expanded again, so a macro can expand into calls of other macros.
+ * Expansion looks inside every S-expression, and inside the Q-expressions
+ * that are code: the body given to \, the branches of if and the
+ * expression given to eval, while those names are the builtins. Any other
+ * Q-expression is data and left as it is, S-expressions in it included.
+ * As with folds (see bopt.c) only a name bound in the root scope and not
+ * shadowed is taken to be a macro, and not in a lambda body binding the
+ * name as a formal. The names in a template are looked up where the
+ * expansion runs, as any other name is under dynamic scope.
+ *
+ * A call left as it was (in data evaluated later, or with a head that
+ * only turns out to be a macro at run time) is rewritten the same way
+ * when it is evaluated: each evaluator looks at the value of the head of
+ * a call before evaluating the rest (see bmac_applies). So a macro call
+ * means the same wherever it is written. Only a macro called as a value,
+ * by map or foldl for instance, is given argument values in place of the
+ * forms (see bmac_call), and one given too few is curried as a lambda is.
+ */
+
+
+// expansions of a call before it is left for run time, in case a macro
+// expands into a call of itself
+#ifndef BMAC_DEPTH
+#define BMAC_DEPTH 256
+#endif
+
+
+// the macro the symbol v names, or NULL
+bval* bmac_macro(bval* v, bscope* scope) {
+  if (BVAL_TYPE(v) != BVAL_SYM || bmac_bound(scope, v->sym)) return NULL;
+  bval* m = bopt_global(v->sym);
+  if (m && BVAL_TYPE(m) == BVAL_FUN && (m->flags & BVAL_F_MACRO)) return m;
+  return NULL;
+}
+
+
+// opcode of the builtin the symbol v names, BOP_NONE for anything else
+int bmac_op(bval* v, bscope* scope) {
+  if (BVAL_TYPE(v) != BVAL_SYM || bmac_bound(scope, v->sym)) return BOP_NONE;
+  bval* f = bopt_global(v->sym);
+  if (!f || BVAL_TYPE(f) != BVAL_FUN || !BVAL_IS_BUILTIN(f)) return BOP_NONE;
+  return f->info->op;
+}
+
+
+/**
+ * Whether sym is a formal of one of the lambdas in scope. Formals given by
+ * an expression instead of a literal, as defn gives them, count every name
+ * in the expression
+ */
+int bmac_bound(bscope* scope, char* sym) {
+  for (bscope* s = scope; s; s = s->outer) {
+    if (bmac_mentions(s->formals, sym)) return 1;
+  }
+  return 0;
+}
+
+
+int bmac_mentions(bval* v, char* sym) {
+  switch (BVAL_TYPE(v)) {
+    case BVAL_SYM:
+      return v->sym == sym;
+
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        if (bmac_mentions(v->cell[i], sym)) return 1;
+      }
+  }
+  return 0;
+}
+
+
+// whether element i of a call of builtin op is code
+int bmac_is_code(int op, int i) {
+  switch (op) {
+    case BOP_LAMBDA: return i == 2;
+    case BOP_IF:     return i == 2 || i == 3;
+    case BOP_EVAL:   return i == 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Expand the macro calls in v, which is taken over, returning the
+ * expanded form. code is set for a Q-expression that will be evaluated,
+ * and scope holds the formals of the lambdas v is in the body of
+ */
+bval* bmac_expand(bval* v, int code, bscope* scope) {
+  int type = BVAL_TYPE(v);
+  if (type != BVAL_SEXPR && type != BVAL_QEXPR) return v;
+  if (type == BVAL_QEXPR && !code) return v;
+
+  // a body compiled by blispc was expanded then
+  if (v->code) return v;
+
+  for (int n = 0; n < BMAC_DEPTH && v->count; n++) {
+    bval* m = bmac_macro(v->cell[0], scope);
+    if (!m || !bmac_arity(m->formals, v->count - 1)) break;
+
+    bval* x = bmac_subst(m->body, m->formals, v->count - 1, &v->cell[1]);
+    x->type = type;
+    bval_del(v);
+    v = x;
+  }
+
+  // the forms are replaced in place
+  bval_unshare(v);
+  int op = v->count ? bmac_op(v->cell[0], scope) : BOP_NONE;
+  bscope body = { NULL, scope };
+
+  for (int i = 0; i < v->count; i++) {
+    // macro templates are expanded where they are used
+    if (op == BOP_MACRO && i == 2) continue;
+
+    // a lambda body is in the scope of its formals
+    if (op == BOP_LAMBDA && i == 2) {
+      body.formals = v->cell[1];
+      v->cell[i] = bmac_expand(v->cell[i], 1, &body);
+      continue;
+    }
+
+    v->cell[i] = bmac_expand(v->cell[i], bmac_is_code(op, i), scope);
+  }
+  return v;
+}
+
+
+// index of the '::' in formals, -1 if there is none
+int bmac_rest(bval* formals) {
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->sym == bsym_varargs) return i;
+  }
+  return -1;
+}
+
+
+// whether a macro with these formals takes argc arguments
+int bmac_arity(bval* formals, int argc) {
+  int rest = bmac_rest(formals);
+  return rest < 0 ? argc == formals->count : argc >= rest;
+}
+
+
+/**
+ * Template t with the formals replaced by the forms in argv, a formal
+ * after '::' by the remaining forms spliced in. The structure of t is
+ * copied, the forms are shared
+ */
+bval* bmac_subst(bval* t, bval* formals, int argc, bval** argv) {
+  int rest = bmac_rest(formals);
+
+  if (BVAL_TYPE(t) == BVAL_SYM) {
+    int n = rest < 0 ? formals->count : rest;
+    for (int i = 0; i < n; i++) {
+      if (formals->cell[i]->sym == t->sym) return bval_retain(argv[i]);
+    }
+    return bval_retain(t);
+  }
+
+  if (BVAL_TYPE(t) != BVAL_SEXPR && BVAL_TYPE(t) != BVAL_QEXPR) {
+    return bval_retain(t);
+  }
+
+  bval* x = BVAL_TYPE(t) == BVAL_SEXPR ? bval_sexpr() : bval_qexpr();
+  for (int i = 0; i < t->count; i++) {
+    bval* c = t->cell[i];
+    if (rest >= 0 && rest + 1 < formals->count && BVAL_TYPE(c) == BVAL_SYM
+        && c->sym == formals->cell[rest + 1]->sym) {
+      for (int j = rest; j < argc; j++) bval_add(x, bval_retain(argv[j]));
+    } else {
+      bval_add(x, bmac_subst(c, formals, argc, argv));
+    }
+  }
+  return x;
+}
+
+
+// whether f is a macro taking argc forms
+int bmac_applies(bval* f, int argc) {
+  return BVAL_TYPE(f) == BVAL_FUN && (f->flags & BVAL_F_MACRO)
+    && bmac_arity(f->formals, argc);
+}
+
+
+/**
+ * The rewrite of the call v, whose head has been evaluated to the macro f,
+ * which is taken over. The forms after the head are shared
+ */
+bval* bmac_rewrite(bval* f, bval* v) {
+  bval* x = bmac_subst(f->body, f->formals, v->count - 1, &v->cell[1]);
+  x->type = BVAL_SEXPR;
+  bval_del(f);
+  return x;
+}
+
+
+// apply macro f to argc argument values, which it takes over, when it is
+// called as a value
+bval* bmac_call(benv* e, bval* f, int argc, bval** argv) {
+  int rest = bmac_rest(f->formals);
+
+  // given fewer arguments it is curried, as a lambda is
+  if (argc < (rest < 0 ? f->formals->count : rest)) {
+    return bmac_partial(f, argc, argv);
+  }
+
+  if (!bmac_arity(f->formals, argc)) {
+    bval_release(argc, argv);
+    return bval_err(
+      rest < 0
+        ? "Macro given %i arguments, expected %i"
+        : "Macro given %i arguments, expected at least %i",
+      argc, rest < 0 ? f->formals->count : rest
+    );
+  }
+
+  bval* x = bmac_subst(f->body, f->formals, argc, argv);
+  bval_release(argc, argv);
+  x->type = BVAL_SEXPR;
+  return bval_eval(e, x);
+}
+
+
+/**
+ * Macro f with its first argc formals replaced in the template by the
+ * argument values argv, which it takes over, taking the formals left
+ */
+bval* bmac_partial(bval* f, int argc, bval** argv) {
+  bval* bound = bval_qexpr();
+  bval* formals = bval_qexpr();
+  for (int i = 0; i < f->formals->count; i++) {
+    bval_add(i < argc ? bound : formals, bval_retain(f->formals->cell[i]));
+  }
+
+  bval* body = bmac_subst(f->body, bound, argc, argv);
+  bval_release(argc, argv);
+  bval_del(bound);
+
+  bval* m = bval_lambda(formals, body);
+  m->flags |= BVAL_F_MACRO;
+  return m;
+}
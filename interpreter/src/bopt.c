@@ -0,0 +1,277 @@
+/**
+ * Constant folding
+ *
+ * Before a loaded form is evaluated, every S-expression in it (including
+ * those inside Q-expressions, which may become lambda bodies) that calls a
+ * pure builtin on constants is computed once. Constants are numbers,
+ * strings, Q-expressions, S-expressions folded the same way, and symbols
+ * naming a number, string or Q-expression in the root scope, such as true,
+ * false and nil from the prelude. Each reference to one of those symbols
+ * is inlined too, wherever it is (see bopt_inline).
+ *
+ * Scope is dynamic, so the form itself is left as it was and the value is
+ * kept with the S-expression (in its code, see bfold) or the symbol,
+ * together with each symbol it was computed from and the version of that
+ * symbol's root binding. The evaluators use the value only while none of those symbols
+ * is bound outside the root scope and none of their root bindings has been
+ * replaced since (see bopt_value), otherwise the expression is evaluated
+ * as usual. Programs still see the forms they wrote as data.
+ *
+ * --no-opt turns folding off, and --dump-opt prints each loaded form with
+ * its folded expressions and inlined symbols replaced by their values.
+ */
+int bopt_enabled = 1;
+int bopt_dump = 0;
+
+
+// fold what can be folded in a loaded form, before it is evaluated
+void bopt_form(bval* form) {
+  if (!bopt_enabled) return;
+
+  // folded values outlive the form's nursery
+  bval_arena.paused++;
+  bval* x = bopt_const(form, NULL);
+  if (x) bval_del(x);
+  bval_arena.paused--;
+
+  if (bopt_dump) {
+    bopt_show(form);
+    putchar('\n');
+  }
+}
+
+
+/**
+ * The constant value of v, or NULL if it has none, folding the
+ * S-expressions in v along the way. The symbols the value was computed
+ * from are added to deps, when given
+ */
+bval* bopt_const(bval* v, bfold* deps) {
+  switch (BVAL_TYPE(v)) {
+    case BVAL_NUM:
+    case BVAL_STR:
+      return bval_retain(v);
+
+    case BVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        bval* x = bopt_const(v->cell[i], NULL);
+        if (x) bval_del(x);
+      }
+      return bval_retain(v);
+
+    case BVAL_SYM: {
+      bval* x = bopt_global(v->sym);
+      if (!x) return NULL;
+      switch (BVAL_TYPE(x)) {
+        case BVAL_NUM:
+        case BVAL_STR:
+        case BVAL_QEXPR:
+          bopt_dep(deps, v->sym);
+          bopt_inline(v, x);
+          return bval_retain(x);
+      }
+      return NULL;
+    }
+
+    case BVAL_SEXPR:
+      return bopt_fold(v, deps);
+  }
+
+  return NULL;
+}
+
+
+// the root binding of a name no other scope binds, or NULL
+bval* bopt_global(char* sym) {
+  bsym* s = BSYM(sym);
+  if (s->shadows || s->global < 0 || !benv_root) return NULL;
+  return benv_root->vals[s->global];
+}
+
+
+// keep the value x of the root constant that symbol v names with the
+// reference, to be used in place of looking it up while the binding holds
+void bopt_inline(bval* v, bval* x) {
+  if (v->inlined && bopt_valid(v->inlined->fold)) return;
+
+  bfold f = { x, 0, NULL, NULL, 0 };
+  bopt_dep(&f, v->sym);
+  bvm_free(v->inlined);
+  v->inlined = bopt_code(BVAL_IS_YOUNG(v), &f);
+
+  free(f.syms);
+  free(f.versions);
+}
+
+
+// note that a folded value depends on the root binding of sym
+void bopt_dep(bfold* deps, char* sym) {
+  if (!deps) return;
+
+  for (int i = 0; i < deps->count; i++) {
+    if (deps->syms[i] == sym) return;
+  }
+
+  if (deps->count == deps->cap) {
+    deps->cap = deps->cap ? deps->cap * 2 : 4;
+    deps->syms = realloc(deps->syms, sizeof(char*) * deps->cap);
+    deps->versions = realloc(deps->versions, sizeof(int) * deps->cap);
+  }
+  deps->syms[deps->count] = sym;
+  deps->versions[deps->count] = BSYM(sym)->version;
+  deps->count++;
+}
+
+
+// the value of S-expression v, folded if it is a pure call on constants
+bval* bopt_fold(bval* v, bfold* deps) {
+  if (v->code && v->code->fold) {
+    bfold* f = v->code->fold;
+    if (!bopt_valid(f)) return NULL;
+    for (int i = 0; i < f->count; i++) bopt_dep(deps, f->syms[i]);
+    return bval_retain(f->value);
+  }
+
+  bval* head = v->count >= 2 && BVAL_TYPE(v->cell[0]) == BVAL_SYM
+    ? bopt_global(v->cell[0]->sym)
+    : NULL;
+
+  int pure = head && BVAL_TYPE(head) == BVAL_FUN && BVAL_IS_BUILTIN(head)
+    && head->info->pure && !head->info->sexpr;
+
+  // the arguments are looked at either way, to fold inside them
+  int argc = v->count - 1;
+  bval* argv[argc > 0 ? argc : 1];
+  bfold found = { NULL, 0, NULL, NULL, 0 };
+  int constant = pure;
+
+  // reading a sequence may evaluate the forms it was made from, which is
+  // left until the code runs
+  for (int i = 1; i < v->count; i++) {
+    argv[i - 1] = bopt_const(v->cell[i], &found);
+    if (!argv[i - 1] || BVAL_TYPE(argv[i - 1]) == BVAL_SEQ) constant = 0;
+  }
+
+  bval* x = NULL;
+  if (constant) {
+    x = bval_builtin(NULL, head, argc, argv);
+    if (BVAL_TYPE(x) == BVAL_ERR) {
+      // left for the evaluator to report
+      bval_del(x);
+      x = NULL;
+    }
+  } else {
+    for (int i = 0; i < argc; i++) {
+      if (argv[i]) bval_del(argv[i]);
+    }
+  }
+
+  if (x) {
+    bopt_dep(&found, v->cell[0]->sym);
+    found.value = x;
+    bvm_free(v->code);
+    v->code = bopt_code(BVAL_IS_YOUNG(v), &found);
+    for (int i = 0; i < found.count; i++) bopt_dep(deps, found.syms[i]);
+  }
+
+  free(found.syms);
+  free(found.versions);
+  return x;
+}
+
+
+// code holding a copy of fold f, in one block
+bcode* bopt_code(int young, bfold* f) {
+  size_t start = BPOOL_CLASS(sizeof(bcode));
+  size_t fold = BPOOL_CLASS(sizeof(bfold));
+  size_t syms = sizeof(char*) * f->count;
+  size_t versions = sizeof(int) * f->count;
+  char* block = bmem_alloc(young, start + fold + syms + versions);
+
+  bcode* code = (bcode*) block;
+  memset(code, 0, sizeof(bcode));
+
+  bfold* x = (bfold*) (block + start);
+  x->value = bval_retain(f->value);
+  x->count = f->count;
+  x->cap = f->count;
+  x->syms = (char**) (block + start + fold);
+  x->versions = (int*) (block + start + fold + syms);
+  memcpy(x->syms, f->syms, syms);
+  memcpy(x->versions, f->versions, versions);
+  code->fold = x;
+  return code;
+}
+
+
+// whether the bindings a folded value was computed from are still in place
+int bopt_valid(bfold* f) {
+  for (int i = 0; i < f->count; i++) {
+    bsym* s = BSYM(f->syms[i]);
+    if (s->shadows || s->version != f->versions[i]) return 0;
+  }
+  return 1;
+}
+
+
+// the folded value of S-expression v, if it has one that still holds
+bval* bopt_value(bval* v) {
+  if (!v->code || !v->code->fold || !bopt_valid(v->code->fold)) return NULL;
+  return bval_retain(v->code->fold->value);
+}
+
+
+// print v with the folded expressions and inlined constants still holding
+// replaced by their values, and strings quoted as they would be written
+void bopt_show(bval* v) {
+  bval* x = BVAL_TYPE(v) == BVAL_SEXPR ? bopt_value(v) : NULL;
+  if (BVAL_TYPE(v) == BVAL_SYM && v->inlined && bopt_valid(v->inlined->fold)) {
+    x = bval_retain(v->inlined->fold->value);
+  }
+  if (x) {
+    bopt_show(x);
+    bval_del(x);
+    return;
+  }
+
+  switch (BVAL_TYPE(v)) {
+    case BVAL_STR:
+      bval_str_print(v);
+      return;
+
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      putchar(BVAL_TYPE(v) == BVAL_SEXPR ? '(' : '{');
+      for (int i = 0; i < v->count; i++) {
+        if (i) putchar(' ');
+        bopt_show(v->cell[i]);
+      }
+      putchar(BVAL_TYPE(v) == BVAL_SEXPR ? ')' : '}');
+      return;
+
+    // these print through bval_print otherwise, leaving strings unquoted
+    case BVAL_SEQ: {
+      bval* parts[3];
+      int n = bseq_parts(v, parts);
+      printf("(%s", bseq_name(v->kind));
+      for (int i = 0; i < n; i++) {
+        putchar(' ');
+        bopt_show(parts[i]);
+        bval_del(parts[i]);
+      }
+      putchar(')');
+      return;
+    }
+
+    case BVAL_FUN:
+      if (BVAL_IS_BUILTIN(v)) break;
+      printf(v->flags & BVAL_F_MACRO ? "(macro " : "(\\ ");
+      bopt_show(v->formals);
+      putchar(' ');
+      bopt_show(v->body);
+      putchar(')');
+      return;
+  }
+
+  bval_print(v);
+}
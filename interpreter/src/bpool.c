@@ -0,0 +1,303 @@
+/**
+ * Slab pool allocator
+ *
+ * Every bval and benv is a fixed size node, and the evaluator creates and
+ * destroys them by the million. Each node type gets its own pool: nodes are
+ * carved out of large slabs and recycled through a per-pool free list, so
+ * allocation and release are a couple of pointer moves. Slabs are only
+ * returned to the system in bulk by bpool_release.
+ *
+ * A free node has BPOOL_FREE as its first byte and keeps the free list link
+ * in its second word, so the collector can tell free nodes from live ones
+ * when it walks a slab.
+ *
+ * Building with -DBLISP_MALLOC sends every node straight to malloc/free,
+ * which keeps tools like valgrind and ASan useful. Each node then has a
+ * header linking it into a list of the pool's live nodes, which the
+ * collector walks instead of the slabs (see bpool_next).
+ */
+bpool bval_pool = { sizeof(bval), NULL, NULL, 0, NULL };
+bpool benv_pool = { sizeof(benv), NULL, NULL, 0, NULL };
+barena bval_arena = { sizeof(bval) };
+
+
+void bpool_grow(bpool* p) {
+  size_t size = BPOOL_CLASS(p->size);
+  bslab* slab = malloc(BPOOL_SLAB_SIZE);
+
+  slab->next = p->slabs;
+  p->slabs = slab;
+
+  // thread every node of the new slab onto the free list
+  char* start = BPOOL_SLAB_START(slab);
+  char* end = (char*) slab + BPOOL_SLAB_SIZE;
+
+  for (char* node = start; node + size <= end; node += size) {
+    *node = BPOOL_FREE;
+    BPOOL_LINK(node) = p->free;
+    p->free = node;
+  }
+}
+
+
+void* bpool_alloc(bpool* p) {
+  p->live++;
+#ifdef BLISP_MALLOC
+  bpool_node* n = malloc(BPOOL_NODE_SIZE + p->size);
+  n->prev = NULL;
+  n->next = p->nodes;
+  if (p->nodes) p->nodes->prev = n;
+  p->nodes = n;
+  return (char*) n + BPOOL_NODE_SIZE;
+#else
+  if (!p->free) bpool_grow(p);
+  void* node = p->free;
+  p->free = BPOOL_LINK(node);
+  return node;
+#endif
+}
+
+
+void bpool_free(bpool* p, void* node) {
+  p->live--;
+#ifdef BLISP_MALLOC
+  bpool_node* n = (bpool_node*) ((char*) node - BPOOL_NODE_SIZE);
+  if (n->prev) {
+    n->prev->next = n->next;
+  } else {
+    p->nodes = n->next;
+  }
+  if (n->next) n->next->prev = n->prev;
+  free(n);
+#else
+  *(char*) node = BPOOL_FREE;
+  BPOOL_LINK(node) = p->free;
+  p->free = node;
+#endif
+}
+
+
+// hand every slab back to the system, invalidating all nodes from the pool
+void bpool_release(bpool* p) {
+  while (p->slabs) {
+    bslab* next = p->slabs->next;
+    free(p->slabs);
+    p->slabs = next;
+  }
+  while (p->nodes) {
+    bpool_node* next = p->nodes->next;
+    free(p->nodes);
+    p->nodes = next;
+  }
+  p->free = NULL;
+  p->live = 0;
+}
+
+
+void bpool_iter_start(bpool_iter* it, bpool* p) {
+  it->pool = p;
+  it->slab = p->slabs;
+  it->node = p->slabs ? BPOOL_SLAB_START(p->slabs) : NULL;
+  it->next = p->nodes;
+}
+
+
+// the next live node of the pool, or NULL after the last one. The node
+// returned may be freed before asking for the next
+void* bpool_next(bpool_iter* it) {
+#ifdef BLISP_MALLOC
+  bpool_node* n = it->next;
+  if (!n) return NULL;
+  it->next = n->next;
+  return (char*) n + BPOOL_NODE_SIZE;
+#else
+  size_t size = BPOOL_CLASS(it->pool->size);
+
+  while (it->slab) {
+    char* end = (char*) it->slab + BPOOL_SLAB_SIZE;
+    while (it->node + size <= end) {
+      char* node = it->node;
+      it->node += size;
+      if (*(unsigned char*) node != BPOOL_FREE) return node;
+    }
+
+    it->slab = it->slab->next;
+    if (it->slab) it->node = BPOOL_SLAB_START(it->slab);
+  }
+  return NULL;
+#endif
+}
+
+
+/**
+ * Nursery
+ *
+ * The form arena is the young generation. Almost every value created while
+ * evaluating a top-level form is dead once that form is done, so while a
+ * form runs (between barena_enter and barena_leave) bvals and their payload
+ * blocks - cell arrays, strings - are bump allocated from the arena and
+ * tagged BVAL_F_ARENA. Anything deleted before the form ends is recycled
+ * through the arena's own free lists, so allocation heavy code runs out of
+ * a warm, fixed set of chunks instead of malloc.
+ *
+ * Survivors are promoted eagerly: a value stored into an environment that
+ * outlives the form is copied out to the pools with the arena paused (see
+ * bval_promote). When the outermost form finishes, nothing young can be
+ * referenced any more and a minor collection is just a pointer reset.
+ * Forms loaded from inside a form share the outer form's nursery.
+ */
+void* barena_bump(barena* a, size_t size) {
+  if ((size_t) (a->end - a->top) < size) {
+    // move on to the next chunk, reusing chunks kept from earlier forms
+    bslab* next = a->chunk ? a->chunk->next : a->first;
+
+    if (!next) {
+      next = malloc(BPOOL_SLAB_SIZE);
+      next->next = NULL;
+      if (a->chunk) {
+        a->chunk->next = next;
+      } else {
+        a->first = next;
+      }
+    }
+
+    a->chunk = next;
+    a->top = BPOOL_SLAB_START(next);
+    a->end = (char*) next + BPOOL_SLAB_SIZE;
+  }
+
+  void* p = a->top;
+  a->top += size;
+  return p;
+}
+
+
+void* barena_alloc(barena* a) {
+  if (a->free) {
+    void* node = a->free;
+    a->free = *(void**) node;
+    return node;
+  }
+  return barena_bump(a, BPOOL_CLASS(a->size));
+}
+
+
+void barena_free(barena* a, void* node) {
+  *(void**) node = a->free;
+  a->free = node;
+}
+
+
+void barena_enter(barena* a) {
+  a->depth++;
+}
+
+
+// leaving the outermost form is a minor collection: the whole nursery is
+// reused from the start
+void barena_leave(barena* a) {
+  if (--a->depth) return;
+
+  a->chunk = NULL;
+  a->top = a->end = NULL;
+  a->free = NULL;
+  for (int i = 0; i < BMEM_CLASSES; i++) a->blocks[i] = NULL;
+  a->minor++;
+}
+
+
+void barena_release(barena* a) {
+  while (a->first) {
+    bslab* next = a->first->next;
+    free(a->first);
+    a->first = next;
+  }
+  a->chunk = NULL;
+  a->top = a->end = NULL;
+  a->free = NULL;
+  for (int i = 0; i < BMEM_CLASSES; i++) a->blocks[i] = NULL;
+}
+
+
+/**
+ * Payload blocks
+ *
+ * Cell arrays and strings owned by a young node come from the nursery in
+ * power of two size classes, anything else from malloc. A small header
+ * records which, so a block can be grown or freed without knowing where it
+ * came from.
+ */
+void* bmem_alloc(int young, size_t size) {
+  size_t total = size + sizeof(bmem_header);
+  bmem_header* h;
+
+#ifndef BLISP_MALLOC
+  if (young && total <= BMEM_MAX) {
+    int class = 0;
+    while ((BMEM_MIN << class) < total) class++;
+
+    if (bval_arena.blocks[class]) {
+      h = bval_arena.blocks[class];
+      bval_arena.blocks[class] = *(void**) h;
+    } else {
+      h = barena_bump(&bval_arena, BMEM_MIN << class);
+    }
+
+    h->class = class;
+    h->size = size;
+    return h + 1;
+  }
+#endif
+
+  h = malloc(total);
+  h->class = BMEM_HEAP;
+  h->size = size;
+  return h + 1;
+}
+
+
+void* bmem_realloc(int young, void* p, size_t size) {
+  if (!p) return bmem_alloc(young, size);
+
+  bmem_header* h = ((bmem_header*) p) - 1;
+
+  if (h->class == BMEM_HEAP) {
+    h = realloc(h, size + sizeof(bmem_header));
+    h->size = size;
+    return h + 1;
+  }
+
+  // still fits the block's size class
+  if (size + sizeof(bmem_header) <= (BMEM_MIN << h->class)) {
+    h->size = size;
+    return p;
+  }
+
+  void* x = bmem_alloc(young, size);
+  memcpy(x, p, h->size < size ? h->size : size);
+  bmem_free(p);
+  return x;
+}
+
+
+void bmem_free(void* p) {
+  if (!p) return;
+
+  bmem_header* h = ((bmem_header*) p) - 1;
+
+  if (h->class == BMEM_HEAP) {
+    free(h);
+  } else {
+    // the link overwrites the header
+    unsigned int class = h->class;
+    *(void**) h = bval_arena.blocks[class];
+    bval_arena.blocks[class] = h;
+  }
+}
+
+
+char* bmem_strdup(int young, char* s) {
+  char* x = bmem_alloc(young, strlen(s) + 1);
+  strcpy(x, s);
+  return x;
+}
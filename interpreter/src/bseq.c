@@ -0,0 +1,361 @@
+/**
+ * Lazy sequences
+ *
+ * (range n), (range from to) and (range from to step) make a sequence of
+ * numbers that is never stored, and (seq l) a sequence of the elements of
+ * Q-expression l. A sequence only describes how to produce its elements.
+ * map, filter, take-while and take given a sequence return another
+ * sequence on top of it, calling their function as each element goes
+ * past, so nothing runs until the sequence is forced by len, foldl, sum,
+ * product, force (which makes a Q-expression of it) or by walking it with
+ * head and tail.
+ *
+ * Walking works out the first element and the sequence of the rest when
+ * they are asked for (bseq_next). Forcing runs the whole chain as one
+ * fused pass instead (bseq_reduce): each element is read from the source
+ * and goes through every stage in turn into the builtin consuming it, so
+ * (sum (map f (filter p (seq l)))) builds no list between the stages.
+ * Either way only the current element is kept alive, so a pass runs in
+ * constant memory however long the sequence is.
+ *
+ * The elements are values rather than forms, so unlike the elements of a
+ * Q-expression they are not evaluated again when read. A sequence is an
+ * immutable value like any other: it can be walked more than once, running
+ * its functions again each time.
+ */
+
+
+/**
+ * The first element of sequence s, which is borrowed, setting *rest to the
+ * sequence of the others, or NULL once s is empty. An error from a
+ * function the sequence calls is returned instead, with *rest left NULL
+ */
+bval* bseq_next(benv* e, bval* s, bval** rest) {
+  bval* x;
+  bval* r;
+  *rest = NULL;
+
+  switch (s->kind) {
+    case BSEQ_RANGE:
+      if (!(s->step > 0 ? s->from < s->to : s->from > s->to)) return NULL;
+      *rest = bval_range(s->from + s->step, s->to, s->step);
+      return bval_num(s->from);
+
+    case BSEQ_LIST:
+      if (s->left >= s->src->count) return NULL;
+      x = bval_eval(e, bval_retain(s->src->cell[s->left]));
+      if (BVAL_TYPE(x) != BVAL_ERR) {
+        *rest = bval_seq(BSEQ_LIST, bval_retain(s->src), NULL, s->left + 1);
+      }
+      return x;
+
+    case BSEQ_MAP:
+      x = bseq_next(e, s->src, &r);
+      if (!x || BVAL_TYPE(x) == BVAL_ERR) return x;
+
+      x = bval_invoke(e, s->fn, 1, &x);
+      if (BVAL_TYPE(x) == BVAL_ERR) {
+        bval_del(r);
+        return x;
+      }
+      *rest = bval_seq(BSEQ_MAP, r, bval_retain(s->fn), 0);
+      return x;
+
+    case BSEQ_FILTER:
+    case BSEQ_TAKE_WHILE: {
+      char* name = bseq_name(s->kind);
+      bval* src = bval_retain(s->src);
+
+      while (1) {
+        x = bseq_next(e, src, &r);
+        bval_del(src);
+        if (!x || BVAL_TYPE(x) == BVAL_ERR) return x;
+
+        int pass;
+        bval* err = bseq_test(e, s->fn, x, name, &pass);
+        if (!err && pass) {
+          *rest = bval_seq(s->kind, r, bval_retain(s->fn), 0);
+          return x;
+        }
+
+        bval_del(x);
+        if (!err && s->kind == BSEQ_FILTER) {
+          // skipped, filter goes on with the rest
+          src = r;
+          continue;
+        }
+        // the end of take-while
+        bval_del(r);
+        return err;
+      }
+    }
+
+    case BSEQ_TAKE:
+      if (s->left <= 0) return NULL;
+      x = bseq_next(e, s->src, &r);
+      if (x && BVAL_TYPE(x) != BVAL_ERR) {
+        *rest = bval_seq(BSEQ_TAKE, r, NULL, s->left - 1);
+      }
+      return x;
+  }
+
+  return NULL;
+}
+
+
+// call predicate fn on x, which is borrowed, setting *pass to whether it
+// held. Returns an error if the call failed or gave something other than
+// a number, which is all if takes as a condition
+bval* bseq_test(benv* e, bval* fn, bval* x, char* name, int* pass) {
+  bval* r = bval_retain(x);
+  r = bval_invoke(e, fn, 1, &r);
+
+  switch (BVAL_TYPE(r)) {
+    case BVAL_NUM:
+      *pass = bval_number(r) != 0;
+      bval_del(r);
+      return NULL;
+
+    case BVAL_ERR:
+      return r;
+  }
+
+  bval* err = bval_err(
+    "Function '%s' needs its predicate to return type %s, given type %s!",
+    name, btype_name(BVAL_NUM), btype_name(BVAL_TYPE(r))
+  );
+  bval_del(r);
+  return err;
+}
+
+
+// head of sequence s: a Q-expression of its first element
+bval* bseq_head(benv* e, bval* s) {
+  bval* r;
+  bval* x = bseq_next(e, s, &r);
+  if (!x) return bval_err("Function 'head' passed empty %s!", btype_name(BVAL_SEQ));
+  if (BVAL_TYPE(x) == BVAL_ERR) return x;
+
+  bval_del(r);
+  return bval_add(bval_qexpr(), x);
+}
+
+
+// tail of sequence s: the sequence after its first element
+bval* bseq_tail(benv* e, bval* s) {
+  bval* r;
+  bval* x = bseq_next(e, s, &r);
+  if (!x) return bval_err("Function 'tail' passed empty %s!", btype_name(BVAL_SEQ));
+  if (BVAL_TYPE(x) == BVAL_ERR) return x;
+
+  bval_del(x);
+  return r;
+}
+
+
+bval* bseq_len(benv* e, bval* s) {
+  if (s->kind == BSEQ_RANGE) {
+    double n = ceil((s->to - s->from) / s->step);
+    return bval_num(n > 0 ? n : 0);
+  }
+  if (s->kind == BSEQ_LIST) return bval_num(s->src->count - s->left);
+  return bseq_reduce(e, s, BOP_LEN, NULL, bval_num(0));
+}
+
+
+/**
+ * Run sequence s in a single pass into the reducer of builtin op (len,
+ * force, foldl with fn, + for sum or * for product), starting from acc,
+ * which is taken over. Rather than building the sequence of each map,
+ * filter or take on the way, every element is read from the source and
+ * taken through all of them in turn, straight into the reducer
+ */
+bval* bseq_reduce(benv* e, bval* s, int op, bval* fn, bval* acc) {
+  int depth = 0;
+  for (bval* x = s; x->kind != BSEQ_RANGE && x->kind != BSEQ_LIST; x = x->src) {
+    depth++;
+  }
+
+  // the stages, outermost first, and the count left to each take
+  bval* stages[depth > 0 ? depth : 1];
+  long left[depth > 0 ? depth : 1];
+  for (int i = 0; i < depth; i++) {
+    stages[i] = s;
+    left[i] = s->left;
+    s = s->src;
+  }
+
+  if (s->kind == BSEQ_RANGE) {
+    for (double x = s->from; s->step > 0 ? x < s->to : x > s->to; x += s->step) {
+      if (bseq_done(stages, left, depth)) break;
+      if (bseq_feed(e, stages, left, depth, op, fn, &acc, bval_num(x))) break;
+    }
+    return acc;
+  }
+
+  for (long i = s->left; i < s->src->count; i++) {
+    if (bseq_done(stages, left, depth)) break;
+
+    bval* x = bval_eval(e, bval_retain(s->src->cell[i]));
+    if (BVAL_TYPE(x) == BVAL_ERR) {
+      bval_del(acc);
+      return x;
+    }
+    if (bseq_feed(e, stages, left, depth, op, fn, &acc, x)) break;
+  }
+  return acc;
+}
+
+
+// whether a take in the stages has had all its elements, which ends the
+// pass before another element is read
+int bseq_done(bval** stages, long* left, int depth) {
+  for (int i = 0; i < depth; i++) {
+    if (stages[i]->kind == BSEQ_TAKE && left[i] <= 0) return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Take element x, which is taken over, through the stages from the
+ * innermost out and into the reducer (see bseq_reduce). Returns 1 once the
+ * pass is over, when take-while stops or on an error, which then replaces
+ * the accumulated value
+ */
+int bseq_feed(benv* e, bval** stages, long* left, int depth, int op,
+    bval* fn, bval** acc, bval* x) {
+  for (int i = depth - 1; i >= 0; i--) {
+    bval* stage = stages[i];
+    int pass;
+    bval* err;
+
+    switch (stage->kind) {
+      case BSEQ_MAP:
+        x = bval_invoke(e, stage->fn, 1, &x);
+        if (BVAL_TYPE(x) == BVAL_ERR) {
+          bval_del(*acc);
+          *acc = x;
+          return 1;
+        }
+        break;
+
+      case BSEQ_FILTER:
+      case BSEQ_TAKE_WHILE:
+        err = bseq_test(e, stage->fn, x, bseq_name(stage->kind), &pass);
+        if (err || !pass) bval_del(x);
+        if (err) {
+          bval_del(*acc);
+          *acc = err;
+          return 1;
+        }
+        if (!pass) return stage->kind == BSEQ_TAKE_WHILE;
+        break;
+
+      case BSEQ_TAKE:
+        left[i]--;
+        break;
+    }
+  }
+
+  *acc = bseq_step(e, op, fn, *acc, x);
+  return BVAL_TYPE(*acc) == BVAL_ERR;
+}
+
+
+// the reducer of builtin op: acc and x, which are taken over, combined
+bval* bseq_step(benv* e, int op, bval* fn, bval* acc, bval* x) {
+  switch (op) {
+    case BOP_LEN: {
+      bval* n = bval_num(bval_number(acc) + 1);
+      bval_del(acc);
+      bval_del(x);
+      return n;
+    }
+
+    case BOP_FORCE:
+      return bval_add(acc, x);
+
+    case BOP_FOLDL: {
+      bval* args[2] = { acc, x };
+      return bval_invoke(e, fn, 2, args);
+    }
+  }
+
+  // sum and product, which + and * check as usual when x isn't a number
+  if (BVAL_TYPE(x) != BVAL_NUM) {
+    bval* args[2] = { acc, x };
+    return builtin_call(e, op, 2, args);
+  }
+
+  double a = bval_number(acc);
+  double b = bval_number(x);
+  bval_del(acc);
+  bval_del(x);
+  return bval_num(op == BOP_ADD ? a + b : a * b);
+}
+
+
+// name of the builtin making a kind of sequence
+char* bseq_name(int kind) {
+  switch (kind) {
+    case BSEQ_RANGE:      return "range";
+    case BSEQ_LIST:       return "seq";
+    case BSEQ_MAP:        return "map";
+    case BSEQ_FILTER:     return "filter";
+    case BSEQ_TAKE_WHILE: return "take-while";
+    case BSEQ_TAKE:       return "take";
+  }
+  return "Invalid";
+}
+
+
+// the arguments of the call that builds a sequence, returning their count
+int bseq_parts(bval* v, bval** parts) {
+  int n = 0;
+
+  switch (v->kind) {
+    case BSEQ_RANGE:
+      parts[n++] = bval_num(v->from);
+      parts[n++] = bval_num(v->to);
+      parts[n++] = bval_num(v->step);
+      break;
+
+    case BSEQ_LIST:
+      // the elements still to come
+      parts[n++] = bval_qexpr();
+      for (long i = v->left; i < v->src->count; i++) {
+        bval_add(parts[0], bval_retain(v->src->cell[i]));
+      }
+      break;
+
+    case BSEQ_TAKE:
+      parts[n++] = bval_num(v->left);
+      parts[n++] = bval_retain(v->src);
+      break;
+
+    default:
+      parts[n++] = bval_retain(v->fn);
+      parts[n++] = bval_retain(v->src);
+  }
+
+  return n;
+}
+
+
+// a sequence prints as the call that builds it
+bval* bseq_to_string(bval* v) {
+  bval* parts[3];
+  int n = bseq_parts(v, parts);
+
+  bval* s = bval_add(bval_qexpr(), bval_str("("));
+  bval_add(s, bval_str(bseq_name(v->kind)));
+  for (int i = 0; i < n; i++) {
+    bval_add(s, bval_str(" "));
+    bval_add(s, bval_to_string(parts[i]));
+    bval_del(parts[i]);
+  }
+  bval_add(s, bval_str(")"));
+
+  return bval_apply(NULL, builtin_join, s);
+}
@@ -0,0 +1,94 @@
+/**
+ * Symbol interning
+ *
+ * Every symbol name is stored once, in a process wide table, and symbol
+ * nodes and environments point at that canonical copy. Two symbols are the
+ * same exactly when their pointers are equal, so environment lookups and
+ * bval_eq never compare strings. Names are interned when source is read,
+ * which keeps hashing out of evaluation.
+ *
+ * Each name is stored in a bsym, which also tracks how the name is bound:
+ * its slot in the root scope, and how many other live scopes bind it. A
+ * name nothing shadows is a plain global, see benv_get.
+ *
+ * The table uses open addressing with linear probing and is kept at most
+ * half full. Interned names live until bsym_release.
+ */
+bsymtab bval_syms = { NULL, 0, 0 };
+
+// the varargs marker in lambda formals
+char* bsym_varargs;
+
+// lambda builtin and its prelude alias, for spotting lambda literals
+char* bsym_lambda;
+char* bsym_fn;
+
+// if, which the VM inlines when it is the builtin
+char* bsym_if;
+
+
+unsigned int bsym_hash(char* name) {
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  for (unsigned char* c = (unsigned char*) name; *c; c++) {
+    h = (h ^ *c) * 16777619u;
+  }
+  return h;
+}
+
+
+void bsym_grow(bsymtab* t) {
+  int cap = t->cap ? t->cap * 2 : 256;
+  char** slots = calloc(cap, sizeof(char*));
+
+  for (int i = 0; i < t->cap; i++) {
+    if (!t->slots[i]) continue;
+    unsigned int j = bsym_hash(t->slots[i]) & (cap - 1);
+    while (slots[j]) j = (j + 1) & (cap - 1);
+    slots[j] = t->slots[i];
+  }
+
+  free(t->slots);
+  t->slots = slots;
+  t->cap = cap;
+}
+
+
+char* bsym_intern(char* name) {
+  bsymtab* t = &bval_syms;
+  if (2 * (t->count + 1) > t->cap) bsym_grow(t);
+
+  unsigned int i = bsym_hash(name) & (t->cap - 1);
+  while (t->slots[i]) {
+    if (strcmp(t->slots[i], name) == 0) return t->slots[i];
+    i = (i + 1) & (t->cap - 1);
+  }
+
+  bsym* s = malloc(sizeof(bsym) + strlen(name) + 1);
+  s->shadows = 0;
+  s->global = -1;
+  s->version = 0;
+  strcpy(s->name, name);
+
+  t->slots[i] = s->name;
+  t->count++;
+  return t->slots[i];
+}
+
+
+void bsym_init(void) {
+  bsym_varargs = bsym_intern("::");
+  bsym_lambda = bsym_intern("\\");
+  bsym_fn = bsym_intern("fn");
+  bsym_if = bsym_intern("if");
+}
+
+
+void bsym_release(bsymtab* t) {
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i]) free(BSYM(t->slots[i]));
+  }
+  free(t->slots);
+  t->slots = NULL;
+  t->count = t->cap = 0;
+}
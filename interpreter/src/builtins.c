@@ -1,228 +1,353 @@
+// argument types in the builtin table
+#define NUM BTYPE(BVAL_NUM)
+#define STR BTYPE(BVAL_STR)
+#define QEXPR BTYPE(BVAL_QEXPR)
+
+/**
+ * Every builtin: its name and function, the fewest and most arguments it
+ * takes, the types of its first arguments and of the rest, whether it is
+ * pure and its opcode
+ */
+bbuiltin_info builtin_table[] = {
+  // list methods
+  { "list", builtin_list, 0, -1, { 0 }, 0, 1, BOP_LIST },
+  { "cons", builtin_cons, 2, 2, { 0 }, 0, 1, BOP_CONS },
+  { "len",  builtin_len,  1, 1, { 0 }, 0, 1, BOP_LEN },
+  { "head", builtin_head, 1, 1, { 0 }, 0, 1, BOP_HEAD },
+  { "tail", builtin_tail, 1, 1, { 0 }, 0, 1, BOP_TAIL },
+  { "init", builtin_init, 1, 1, { QEXPR }, 0, 1, BOP_INIT },
+  { "eval", builtin_eval, 1, 1, { QEXPR }, 0, 0, BOP_EVAL },
+  { "join", builtin_join, 1, -1, { 0 }, 0, 1, BOP_JOIN },
+
+  { "def",    builtin_def,       1, -1, { QEXPR }, 0, 0, BOP_DEF },
+  { "var",    builtin_var,       1, -1, { QEXPR }, 0, 0, BOP_VAR },
+  { "env",    builtin_env,       1, 1, { NUM }, 0, 0, BOP_ENV },
+  { "sizeof", builtin_sizeof,    1, 1, { STR }, 0, 1, BOP_SIZEOF },
+  { "gc",     builtin_gc,        1, 1, { NUM }, 0, 0, BOP_GC },
+  { "\\",     builtin_lambda,    2, 2, { QEXPR, QEXPR }, 0, 0, BOP_LAMBDA },
+  { "macro",  builtin_macro,     2, 2, { QEXPR, QEXPR }, 0, 0, BOP_MACRO },
+  { "type",   builtin_type,      1, 1, { 0 }, 0, 1, BOP_TYPE },
+  { "load",   builtin_load,      1, 1, { STR }, 0, 0, BOP_LOAD },
+  { "read",   builtin_read,      1, 1, { STR }, 0, 0, BOP_READ },
+  { "print",  builtin_print,     0, -1, { 0 }, 0, 0, BOP_PRINT },
+  { "show",   builtin_show,      0, -1, { STR, STR, STR }, STR, 0, BOP_SHOW },
+  { "error",  builtin_error,     1, 1, { STR }, 0, 0, BOP_ERROR },
+  { "exit",   builtin_exit,      1, 1, { NUM }, 0, 0, BOP_EXIT },
+  { "fread",  builtin_fread,     1, 1, { STR }, 0, 0, BOP_FREAD },
+  { "fwrite", builtin_fwrite,    2, 2, { STR, STR }, 0, 0, BOP_FWRITE },
+  { "string", builtin_to_string, 1, 1, { 0 }, 0, 1, BOP_STRING },
+
+  // math methods
+  { "+",   builtin_add, 1, -1, { NUM, NUM, NUM }, NUM, 1, BOP_ADD },
+  { "-",   builtin_sub, 1, -1, { NUM, NUM, NUM }, NUM, 1, BOP_SUB },
+  { "*",   builtin_mul, 1, -1, { NUM, NUM, NUM }, NUM, 1, BOP_MUL },
+  { "/",   builtin_div, 1, -1, { NUM, NUM, NUM }, NUM, 1, BOP_DIV },
+  { "%",   builtin_mod, 1, -1, { NUM, NUM, NUM }, NUM, 1, BOP_MOD },
+  { "not", builtin_not, 1, 1, { NUM }, 0, 1, BOP_NOT },
+
+  { "if", builtin_if, 3, 3, { NUM, QEXPR, QEXPR }, 0, 0, BOP_IF },
+  { "<",  builtin_lt, 2, 2, { NUM, NUM }, 0, 1, BOP_LT },
+  { ">",  builtin_gt, 2, 2, { NUM, NUM }, 0, 1, BOP_GT },
+  { "<=", builtin_le, 2, 2, { NUM, NUM }, 0, 1, BOP_LE },
+  { ">=", builtin_ge, 2, 2, { NUM, NUM }, 0, 1, BOP_GE },
+  { "=",  builtin_eq, 2, 2, { 0 }, 0, 1, BOP_EQ },
+  { "!=", builtin_ne, 2, 2, { 0 }, 0, 1, BOP_NE },
+
+  // prelude list functions
+  { "nth",     builtin_nth,     2, 2, { 0 }, 0, 0, BOP_NTH, NULL, 1 },
+  { "last",    builtin_last,    1, 1, { 0 }, 0, 0, BOP_LAST, NULL, 1 },
+  { "take",    builtin_take,    2, 2, { 0 }, 0, 0, BOP_TAKE, NULL, 1 },
+  { "drop",    builtin_drop,    2, 2, { 0 }, 0, 0, BOP_DROP, NULL, 1 },
+  { "map",     builtin_map,     2, 2, { 0 }, 0, 0, BOP_MAP, NULL, 1 },
+  { "foldl",   builtin_foldl,   3, 3, { 0 }, 0, 0, BOP_FOLDL, NULL, 1 },
+  { "sum",     builtin_sum,     1, 1, { 0 }, 0, 0, BOP_SUM, NULL, 1 },
+  { "product", builtin_product, 1, 1, { 0 }, 0, 0, BOP_PRODUCT, NULL, 1 },
+  { "joins",   builtin_joins,   0, -1, { 0 }, 0, 1, BOP_JOINS },
+
+  // lazy sequences, see bseq.c
+  { "range",      builtin_range,      1, 3, { NUM, NUM, NUM }, 0, 1, BOP_RANGE },
+  { "filter",     builtin_filter,     2, 2, { 0 }, 0, 0, BOP_FILTER, NULL, 1 },
+  { "take-while", builtin_take_while, 2, 2, { 0 }, 0, 0, BOP_TAKE_WHILE, NULL, 1 },
+  { "force",      builtin_force,      1, 1, { 0 }, 0, 0, BOP_FORCE },
+  { "seq",        builtin_seq,        1, 1, { QEXPR }, 0, 0, BOP_SEQ },
+
+  { NULL }
+};
+
+#undef NUM
+#undef STR
+#undef QEXPR
+
+
 // math builtins
-bval* builtin_add(benv* e, bval* a) { return builtin_op(e, a, "+"); }
-bval* builtin_sub(benv* e, bval* a) { return builtin_op(e, a, "-"); }
-bval* builtin_mul(benv* e, bval* a) { return builtin_op(e, a, "*"); }
-bval* builtin_div(benv* e, bval* a) { return builtin_op(e, a, "/"); }
-bval* builtin_mod(benv* e, bval* a) { return builtin_op(e, a, "%"); }
+bval* builtin_add(benv* e, int argc, bval** argv) { return builtin_op(e, argc, argv, BOP_ADD); }
+bval* builtin_sub(benv* e, int argc, bval** argv) { return builtin_op(e, argc, argv, BOP_SUB); }
+bval* builtin_mul(benv* e, int argc, bval** argv) { return builtin_op(e, argc, argv, BOP_MUL); }
+bval* builtin_div(benv* e, int argc, bval** argv) { return builtin_op(e, argc, argv, BOP_DIV); }
+bval* builtin_mod(benv* e, int argc, bval** argv) { return builtin_op(e, argc, argv, BOP_MOD); }
 
 // comparator builtins
-bval* builtin_lt(benv* e, bval* a) { return builtin_ord(e, a, "<"); }
-bval* builtin_gt(benv* e, bval* a) { return builtin_ord(e, a, ">"); }
-bval* builtin_le(benv* e, bval* a) { return builtin_ord(e, a, "<="); }
-bval* builtin_ge(benv* e, bval* a) { return builtin_ord(e, a, ">="); }
-bval* builtin_eq(benv* e, bval* a) { return builtin_cmp(e, a, "="); }
-bval* builtin_ne(benv* e, bval* a) { return builtin_cmp(e, a, "!="); }
-
-
-bval* builtin_env(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "env");
-  ASSERT_ARG_TYPE(a, 0, BVAL_NUM, "env");
-  bval* show_builtins = bval_pop(a, 0);
-  benv_print(e, show_builtins->num);
-  bval_del(show_builtins);
-  bval_del(a);
+bval* builtin_lt(benv* e, int argc, bval** argv) { return builtin_ord(e, argc, argv, BOP_LT); }
+bval* builtin_gt(benv* e, int argc, bval** argv) { return builtin_ord(e, argc, argv, BOP_GT); }
+bval* builtin_le(benv* e, int argc, bval** argv) { return builtin_ord(e, argc, argv, BOP_LE); }
+bval* builtin_ge(benv* e, int argc, bval** argv) { return builtin_ord(e, argc, argv, BOP_GE); }
+bval* builtin_eq(benv* e, int argc, bval** argv) { return builtin_cmp(e, argc, argv, BOP_EQ); }
+bval* builtin_ne(benv* e, int argc, bval** argv) { return builtin_cmp(e, argc, argv, BOP_NE); }
+
+
+bval* builtin_env(benv* e, int argc, bval** argv) {
+  benv_print(e, bval_number(argv[0]));
   return bval_ok();
 }
 
-bval* builtin_def(benv* e, bval* a) {
-  return builtin_variable(e, a, "def");
+// report the in-memory size of interpreter structures
+bval* builtin_sizeof(benv* e, int argc, bval** argv) {
+
+  char* name = argv[0]->str;
+
+  if (strcmp(name, "bval") == 0) return bval_num(sizeof(bval));
+  if (strcmp(name, "benv") == 0) return bval_num(sizeof(benv));
+  return bval_err("Function 'sizeof' given unknown structure '%s'!", name);
 }
 
-bval* builtin_var(benv* e, bval* a) {
-  return builtin_variable(e, a, "var");
+// collector statistics, optionally requesting a collection at the next
+// safe point: {collections freed total-pause-ms max-pause-ms minor}, the
+// last being how many times the nursery has been reset (see barena_leave)
+bval* builtin_gc(benv* e, int argc, bval** argv) {
+
+  if (bval_number(argv[0])) bval_gc.requested = 1;
+
+  bval* x = bval_qexpr();
+  bval_add(x, bval_num(bval_gc.collections));
+  bval_add(x, bval_num(bval_gc.freed));
+  bval_add(x, bval_num(bval_gc.pause_total));
+  bval_add(x, bval_num(bval_gc.pause_max));
+  bval_add(x, bval_num(bval_arena.minor));
+  return x;
 }
 
 
-bval* builtin_variable(benv* e, bval* a, char* fn) {
-  ASSERT_ARG_TYPE(a, 0, BVAL_QEXPR, fn);
+bval* builtin_def(benv* e, int argc, bval** argv) {
+  return builtin_variable(e, argc, argv, "def");
+}
+
+bval* builtin_var(benv* e, int argc, bval** argv) {
+  return builtin_variable(e, argc, argv, "var");
+}
 
-  bval* syms = a->cell[0];
+
+bval* builtin_variable(benv* e, int argc, bval** argv, char* fn) {
+
+  bval* syms = argv[0];
 
   for (int i = 0; i < syms->count; i++) {
-    ASSERT(a, syms->cell[i]->type == BVAL_SYM,
+    ASSERT(BVAL_TYPE(syms->cell[i]) == BVAL_SYM,
       "Function '%s' cannot define non-symbol!"
       "Got %s, Expected %s.", fn,
-      btype_name(syms->cell[i]->type),
+      btype_name(BVAL_TYPE(syms->cell[i])),
       btype_name(BVAL_SYM));
   }
 
-  ASSERT(a, syms->count == a->count - 1,
+  ASSERT(syms->count == argc - 1,
     "Function '%s' must have symbol for each value!"
     "Got %i symbols, expected %i symbols.",
-    fn, syms->count, a->count - 1);
+    fn, syms->count, argc - 1);
 
   for (int i = 0; i < syms->count; i++) {
     if (strcmp(fn, "def") == 0) {
-      benv_def(e, syms->cell[i], a->cell[i + 1]);
+      benv_def(e, syms->cell[i], argv[i + 1]);
     }
     if (strcmp(fn, "var") == 0) {
-      benv_put(e, syms->cell[i], a->cell[i + 1]);
+      benv_put(e, syms->cell[i], argv[i + 1]);
     }
   }
 
-  bval_del(a);
-
   return bval_ok();
 }
 
 
-bval* builtin_lambda(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 2, "\\");
-  ASSERT_ARG_TYPE(a, 0, BVAL_QEXPR, "\\");
-  ASSERT_ARG_TYPE(a, 1, BVAL_QEXPR, "\\");
+bval* builtin_lambda(benv* e, int argc, bval** argv) {
 
-  bval* arg_list = a->cell[0];
+  bval* arg_list = argv[0];
 
   for (int i = 0; i < arg_list->count; i++) {
     bval* arg = arg_list->cell[i];
-    ASSERT(a, (arg->type == BVAL_SYM),
+    ASSERT((BVAL_TYPE(arg) == BVAL_SYM),
       "Cannot define non-symbol. Got %s, Expected %s.",
-      btype_name(arg->type), btype_name(BVAL_SYM));
+      btype_name(BVAL_TYPE(arg)), btype_name(BVAL_SYM));
   }
 
-  bval* formals = bval_pop(a, 0);
-  bval* body = bval_pop(a, 0);
-  bval_del(a);
+  bval* formals = bval_claim(argv, 0);
+  bval* body = bval_claim(argv, 1);
+
+  // the same body is often wrapped again, e.g. each time a literal in
+  // another lambda is evaluated
+  if (!(body->flags & BVAL_F_RESOLVED)) {
+    bscope scope = { formals, NULL };
+    bval_resolve(body, &scope);
+    body->flags |= BVAL_F_RESOLVED;
+  }
+
+  if (bvm_enabled) bvm_code(body);
+  if (bclo_enabled) bclo_code(body);
+
+  // plain formals let the VM bind arguments straight into a frame
+  int plain = 1;
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->sym == bsym_varargs) plain = 0;
+    for (int j = 0; j < i; j++) {
+      if (formals->cell[j]->sym == formals->cell[i]->sym) plain = 0;
+    }
+  }
+  if (plain) formals->flags |= BVAL_F_PLAIN;
+  if (bjit_enabled) bjit_compile(formals, body);
 
   return bval_lambda(formals, body);
 }
 
 
-bval* builtin_print(benv* e, bval* a) {
-  for (int i = 0; i < a->count; i++) {
-    bval_print(a->cell[i]);
+bval* builtin_macro(benv* e, int argc, bval** argv) {
+
+  bval* arg_list = argv[0];
+
+  for (int i = 0; i < arg_list->count; i++) {
+    bval* arg = arg_list->cell[i];
+    ASSERT((BVAL_TYPE(arg) == BVAL_SYM),
+      "Cannot define non-symbol. Got %s, Expected %s.",
+      btype_name(BVAL_TYPE(arg)), btype_name(BVAL_SYM));
+  }
+
+  // the template is only ever substituted into, never run as a body
+  bval* m = bval_lambda(bval_claim(argv, 0), bval_claim(argv, 1));
+  m->flags |= BVAL_F_MACRO;
+  return m;
+}
+
+
+bval* builtin_print(benv* e, int argc, bval** argv) {
+  for (int i = 0; i < argc; i++) {
+    bval_print(argv[i]);
     putchar(' ');
   }
   putchar('\n');
-  bval_del(a);
   return bval_ok();
 }
 
 
-bval* builtin_show(benv* e, bval* a) {
-  for (int i = 0; i < a->count; i++) {
-    ASSERT_ARG_TYPE(a, i, BVAL_STR, "show");
-    printf("%s", a->cell[i]->str);
+bval* builtin_show(benv* e, int argc, bval** argv) {
+  for (int i = 0; i < argc; i++) {
+    printf("%s", argv[i]->str);
     putchar(' ');
   }
   putchar('\n');
-  bval_del(a);
   return bval_ok();
 }
 
 
-bval* builtin_error(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "error");
-  ASSERT_ARG_TYPE(a, 0, BVAL_STR, "error");
-
-  bval* err = bval_err(a->cell[0]->str);
-  bval_del(a);
-  return err;
+bval* builtin_error(benv* e, int argc, bval** argv) {
+  return bval_err(argv[0]->str);
 }
 
 
-bval* builtin_exit(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "exit");
-  ASSERT_ARG_TYPE(a, 0, BVAL_NUM, "exit");
+bval* builtin_exit(benv* e, int argc, bval** argv) {
   printf("Exiting!");
-  exit(!!a->cell[0]->num);
+  exit(!!bval_number(argv[0]));
   return bval_ok();
 }
 
 
-bval* builtin_fwrite(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 2, "fwrite");
-  ASSERT_ARG_TYPE(a, 0, BVAL_STR, "fwrite");
-  ASSERT_ARG_TYPE(a, 1, BVAL_STR, "fwrite");
+bval* builtin_fwrite(benv* e, int argc, bval** argv) {
 
-  bval* file_param = bval_pop(a, 0);
-  bval* out_string = bval_pop(a, 0);
-  bval* x;
+  char* file_name = argv[0]->str;
+  FILE* input_file = fopen(file_name, "w");
 
-  FILE* input_file = fopen(file_param->str, "w");
-
-  if (input_file) {
-    fprintf(input_file, "%s", out_string->str);
-    fclose(input_file);
-    x = bval_num(1);
-  } else {
-    x = bval_err("File '%s' failed to open.", file_param->str);
-  }
+  if (!input_file) return bval_err("File '%s' failed to open.", file_name);
 
-  bval_del(file_param);
-  return x;
+  fprintf(input_file, "%s", argv[1]->str);
+  fclose(input_file);
+  return bval_num(1);
 }
 
 
-bval* builtin_fread(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "fread");
-  ASSERT_ARG_TYPE(a, 0, BVAL_STR, "fread");
-
-  bval* file_param = bval_pop(a, 0);
-  bval* x;
+bval* builtin_fread(benv* e, int argc, bval** argv) {
 
+  char* file_name = argv[0]->str;
   char* file_contents;
   size_t input_file_size;
 
-  FILE* input_file = fopen(file_param->str, "rb");
-  if (input_file) {
-    fseek(input_file, 0, SEEK_END);
-    input_file_size = ftell(input_file);
-    rewind(input_file);
-    file_contents = malloc((input_file_size + 1) * (sizeof(char)));
-    fread(file_contents, sizeof(char), input_file_size, input_file);
-    fclose(input_file);
-    file_contents[input_file_size] = '\0';
-    x = bval_str(file_contents);
-  } else {
-    x = bval_err("File '%s' not found.", file_param->str);
-  }
+  FILE* input_file = fopen(file_name, "rb");
+  if (!input_file) return bval_err("File '%s' not found.", file_name);
+
+  fseek(input_file, 0, SEEK_END);
+  input_file_size = ftell(input_file);
+  rewind(input_file);
+  file_contents = malloc((input_file_size + 1) * (sizeof(char)));
+  fread(file_contents, sizeof(char), input_file_size, input_file);
+  fclose(input_file);
+  file_contents[input_file_size] = '\0';
 
-  bval_del(file_param);
+  bval* x = bval_str(file_contents);
+  free(file_contents);
   return x;
 }
 
 
-bval* builtin_load(benv* e, bval* a) {
-  return bultin_load_file(e, a, "load");
+/**
+ * Evaluate a top level form of a loaded file in the nursery, printing
+ * what load shows of its value. The macro calls in it are expanded and
+ * constant expressions folded first (see bmac.c and bopt.c)
+ */
+void builtin_load_form(benv* e, bval* form) {
+  form = bmac_expand(form, 0, NULL);
+  bopt_form(form);
+  barena_enter(&bval_arena);
+  bval* x = bval_eval(e, form);
+
+  switch (BVAL_TYPE(x)) {
+    case BVAL_ERR:
+    case BVAL_STR:
+    case BVAL_NUM:
+      bval_println(x);
+  }
+
+  bval_del(x);
+  barena_leave(&bval_arena);
+  bgc_safepoint(e);
+}
+
+
+bval* builtin_load(benv* e, int argc, bval** argv) {
+  return bultin_load_file(e, argc, argv, "load");
 }
 
-bval* builtin_read(benv* e, bval* a) {
-  return bultin_load_file(e, a, "read");
+bval* builtin_read(benv* e, int argc, bval** argv) {
+  return bultin_load_file(e, argc, argv, "read");
 }
 
-bval* bultin_load_file(benv* e, bval* a, char* op) {
-  ASSERT_ARG_LEN(a, 1, op);
-  ASSERT_ARG_TYPE(a, 0, BVAL_STR, op);
+bval* bultin_load_file(benv* e, int argc, bval** argv, char* op) {
 
   mpc_result_t r;
 
-  if (mpc_parse_contents(a->cell[0]->str, Blisp, &r)) {
+  if (mpc_parse_contents(argv[0]->str, Blisp, &r)) {
     bval* expr = bval_read(r.output);
     mpc_ast_delete(r.output);
 
     if (strcmp(op, "read") == 0) {
       expr->type = BVAL_QEXPR;
-      bval_del(a);
       return expr;
     };
 
+    // the pending forms and the argument stay live between forms
+    bgc_push(argv[0]);
+    bgc_push(expr);
+
     // pop expressions off stack and eval
-    while(expr->count) {
-      bval* x = bval_eval(e, bval_pop(expr, 0));
-
-      switch (x->type) {
-        case BVAL_ERR:
-        case BVAL_STR:
-        case BVAL_NUM:
-          bval_println(x);
-      }
+    while(expr->count) builtin_load_form(e, bval_pop(expr, 0));
 
-      bval_del(x);
-    }
+    bgc_pop();
+    bgc_pop();
 
     bval_del(expr);
-    bval_del(a);
 
     return bval_ok();
   } else {
@@ -230,347 +355,665 @@ bval* bultin_load_file(benv* e, bval* a, char* op) {
     mpc_err_delete(r.error);
     bval* err = bval_err("Could not %s library due to error: %s", op, error_msg);
     free(error_msg);
-    bval_del(a);
     return err;
   }
 }
 
 
-bval* builtin_type(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "type");
-  bval* x = bval_pop(a, 0);
-  bval* r = bval_str(btype_name(x->type));
-  bval_del(x);
-  bval_del(a);
-  return r;
+bval* builtin_type(benv* e, int argc, bval** argv) {
+  return bval_str(btype_name(BVAL_TYPE(argv[0])));
 }
 
 
-bval* builtin_cons(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 2, "cons");
+bval* builtin_cons(benv* e, int argc, bval** argv) {
 
   bval* v;
 
   // switch on second arg to proceed
-  switch (a->cell[1]->type) {
+  switch (BVAL_TYPE(argv[1])) {
 
     case BVAL_STR:
       // for strings, join is the same as cons
-      ASSERT_ARG_TYPE(a, 0, BVAL_STR, "cons");
-      ASSERT(a, strlen(a->cell[0]->str) == 1,
+      ASSERT_ARG_TYPE(argv, 0, BVAL_STR, "cons");
+      ASSERT(strlen(argv[0]->str) == 1,
         "Function cons takes a single character as the first argument.");
-      return builtin_join(e, a);
+      return builtin_join(e, argc, argv);
 
     case BVAL_QEXPR:
-      // create a new q expression with the first arg of cons
-      // as its first element
-      v = bval_add(bval_qexpr(), bval_pop(a, 0));
-      // join the new q expression with the qexpr passed to cons
-      v = bval_join(v, bval_pop(a, 0));
+      // put the first arg of cons in front of the qexpr passed to cons,
+      // in the room before its elements if there is some
+      v = bval_prepend(bval_claim(argv, 0), bval_claim(argv, 1));
       break;
 
     default:
       v = bval_err(
         "Invalid type passed as second argument to cons. Got %s, Expected %s or %s.",
-        btype_name(a->cell[0]->type), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
+        btype_name(BVAL_TYPE(argv[0])), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
       );
       break;
   }
 
-  bval_del(a);
   return v;
 }
 
 
-bval* builtin_init(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "init");
-  ASSERT_ARG_TYPE(a, 0, BVAL_QEXPR, "init");
-  ASSERT_NOT_EMPTY(a, "init");
+bval* builtin_init(benv* e, int argc, bval** argv) {
+  ASSERT_NOT_EMPTY(argv, "init");
 
-  bval* v = bval_take(a, 0);
-  bval_del(bval_pop(v, v->count - 1));
-  return v;
+  // a narrower slice of the same elements
+  bval* v = bval_claim(argv, 0);
+  return bval_slice(v, 0, v->count - 1);
 }
 
 
-bval* builtin_len(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "len");
+bval* builtin_len(benv* e, int argc, bval** argv) {
 
-  bval* v;
-
-  switch (a->cell[0]->type) {
+  switch (BVAL_TYPE(argv[0])) {
     case BVAL_QEXPR:
-      v = bval_num((double) a->cell[0]->count);
-      break;
+      return bval_num((double) argv[0]->count);
 
     case BVAL_STR:
-      v = bval_num((double) strlen(a->cell[0]->str));
-      break;
+      return bval_num((double) strlen(argv[0]->str));
+
+    case BVAL_SEQ:
+      return bseq_len(e, argv[0]);
 
     default:
-      v = bval_err(
+      return bval_err(
         "Invalid type passed to len. Got %s, Expected %s or %s.",
-        btype_name(a->cell[0]->type), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
+        btype_name(BVAL_TYPE(argv[0])), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
       );
-      break;
-
   }
-
-  bval_del(a);
-  return v;
 }
 
 
-bval* builtin_head(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "head");
-  ASSERT_NOT_EMPTY(a, "head");
-
-  bval* v;
+bval* builtin_head(benv* e, int argc, bval** argv) {
+  if (BVAL_TYPE(argv[0]) == BVAL_SEQ) return bseq_head(e, argv[0]);
+  ASSERT_NOT_EMPTY(argv, "head");
 
-  switch (a->cell[0]->type) {
+  switch (BVAL_TYPE(argv[0])) {
 
     case BVAL_QEXPR:
-      v = bval_take(a, 0);
-      // delete remaining elements
-      while (v->count > 1) bval_del(bval_pop(v, 1));
-      break;
+      // new list sharing the first element
+      return bval_add(bval_qexpr(), bval_retain(argv[0]->cell[0]));
 
     case BVAL_STR:
-      a->cell[0]->str[1] = '\0';
-      v = bval_str(a->cell[0]->str);
-      bval_del(a);
-      break;
+      // the string may be shared, so copy out its first character
+      return bval_str((char[]) { argv[0]->str[0], '\0' });
 
     default:
-      v = bval_err(
+      return bval_err(
         "Invalid type passed to head. Got %s, Expected %s or %s.",
-        btype_name(a->cell[0]->type), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
+        btype_name(BVAL_TYPE(argv[0])), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
       );
-      bval_del(a);
-      break;
-
   }
-
-  return v;
 }
 
 
-bval* builtin_tail(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "tail");
-  ASSERT_NOT_EMPTY(a, "tail");
+bval* builtin_tail(benv* e, int argc, bval** argv) {
+  if (BVAL_TYPE(argv[0]) == BVAL_SEQ) return bseq_tail(e, argv[0]);
+  ASSERT_NOT_EMPTY(argv, "tail");
 
   bval* v;
 
-  switch (a->cell[0]->type) {
+  switch (BVAL_TYPE(argv[0])) {
 
     case BVAL_QEXPR:
-      v = bval_take(a, 0);
-      bval_del(bval_pop(v, 0));
-      break;
+      // a narrower slice of the same elements
+      v = bval_claim(argv, 0);
+      return bval_slice(v, 1, v->count);
 
     case BVAL_STR:
-      // increment string pointer
-      v = bval_str(a->cell[0]->str + 1);
-      bval_del(a);
-      break;
+      // a view from the second character on
+      return bval_substr(bval_claim(argv, 0), 1);
 
     default:
-      v = bval_err(
+      return bval_err(
         "Invalid type passed to tail. Got %s, Expected %s or %s.",
-        btype_name(a->cell[0]->type), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
+        btype_name(BVAL_TYPE(argv[0])), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
       );
-      bval_del(a);
-      break;
-
   }
-
-  return v;
 }
 
 
-bval* builtin_to_string(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "string");
-  return bval_to_string(bval_take(a, 0));
+bval* builtin_to_string(benv* e, int argc, bval** argv) {
+  return bval_to_string(argv[0]);
 }
 
 
-bval* builtin_list(benv* e, bval* a) {
-  a->type = BVAL_QEXPR;
-  return a;
+// the arguments, taken over as the elements of a new list
+bval* builtin_list(benv* e, int argc, bval** argv) {
+  bval* x = bval_qexpr();
+  if (!argc) return x;
+
+  bval_room(x, argc);
+  for (int i = 0; i < argc; i++) bval_add(x, bval_claim(argv, i));
+  return x;
 }
 
 
-bval* builtin_eval(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "eval");
-  ASSERT_ARG_TYPE(a, 0, BVAL_QEXPR, "eval");
+bval* builtin_eval(benv* e, int argc, bval** argv) {
 
-  bval* x = bval_take(a, 0);
+  bval* x = bval_own(bval_claim(argv, 0));
   x->type = BVAL_SEXPR;
   return bval_eval(e, x);
 }
 
 
-bval* builtin_join(benv* e, bval* a) {
-
-  // get first val
-  bval* x = bval_pop(a, 0);
-
+bval* builtin_join(benv* e, int argc, bval** argv) {
   int total_size;
+  bval* x;
 
-  switch (x->type) {
+  switch (BVAL_TYPE(argv[0])) {
 
     case BVAL_QEXPR:
-      for (int i = 0; i < a->count; i++) {
-        ASSERT_ARG_TYPE(a, i, BVAL_QEXPR, "join");
+      for (int i = 1; i < argc; i++) {
+        ASSERT_ARG_TYPE(argv, i, BVAL_QEXPR, "join");
       }
-      while (a->count) x = bval_join(x, bval_pop(a, 0));
-      break;
+
+      // the first list is extended in place, or past the end of the
+      // elements it shares when no one has used the room there yet
+      x = bval_claim(argv, 0);
+      x = bval_slice(x, 0, x->count);
+      for (int i = 1; i < argc; i++) x = bval_join(x, bval_claim(argv, i));
+      return x;
 
     case BVAL_STR:
-      total_size = strlen(x->str);
+      total_size = strlen(argv[0]->str);
 
-      for (int i = 0; i < a->count; i++) {
-        ASSERT_ARG_TYPE(a, i, BVAL_STR, "join");
-        total_size += strlen(a->cell[i]->str);
+      for (int i = 1; i < argc; i++) {
+        ASSERT_ARG_TYPE(argv, i, BVAL_STR, "join");
+        total_size += strlen(argv[i]->str);
       }
 
-      char* new_str = malloc(total_size + 1);
+      x = bval_own(bval_claim(argv, 0));
+      char* new_str = bmem_alloc(BVAL_IS_YOUNG(x), total_size + 1);
 
       strcpy(new_str, x->str);
 
-      for (int i = 0; i < a->count; i++) {
-        strcat(new_str, a->cell[i]->str);
+      for (int i = 1; i < argc; i++) {
+        strcat(new_str, argv[i]->str);
       }
 
-      free(x->str);
-      x->str = malloc(strlen(new_str) + 1);
-      strcpy(x->str, new_str);
-      break;
+      bmem_free(x->str);
+      x->str = new_str;
+      return x;
 
     default:
-      x = bval_err(
+      return bval_err(
         "Invalid type passed to join. Got %s, Expected %s or %s.",
-        btype_name(x->type), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
+        btype_name(BVAL_TYPE(argv[0])), btype_name(BVAL_STR), btype_name(BVAL_QEXPR)
       );
   }
+}
+
+
+/**
+ * The prelude's list functions, run as loops over the list instead of
+ * recursing on copies of its tail. Like first, they evaluate the elements
+ * they read, and they call the same builtins on what they can't handle
+ * directly, so they fail with the same errors. Given fewer arguments they
+ * return a partial application, as a lambda would (see bval_partial).
+ * A function they call is called from the caller's frame, so under dynamic
+ * scope it sees the caller's bindings as it did through the prelude; only
+ * the prelude function's own parameters (f, l and so on) are gone
+ */
+bval* builtin_nth(benv* e, int argc, bval** argv) {
+  bval* l = argv[1];
+
+  if (BVAL_TYPE(argv[0]) == BVAL_NUM && BVAL_TYPE(l) == BVAL_QEXPR) {
+    double n = bval_number(argv[0]);
+    if (n >= 0 && n < l->count && n == (int) n) {
+      return bval_eval(e, bval_retain(l->cell[(int) n]));
+    }
+  }
+
+  return builtin_nth_walk(e, bval_retain(argv[0]), bval_retain(l));
+}
+
+
+// nth step by step, taking over n and l
+bval* builtin_nth_walk(benv* e, bval* n, bval* l) {
+  while (BVAL_TYPE(n) != BVAL_NUM || bval_number(n) != 0) {
+    bval* args[2] = { n, bval_num(1) };
+    n = builtin_call(e, BOP_SUB, 2, args);
+    if (BVAL_TYPE(n) == BVAL_ERR) {
+      bval_del(l);
+      return n;
+    }
+
+    l = builtin_call(e, BOP_TAIL, 1, &l);
+    if (BVAL_TYPE(l) == BVAL_ERR) {
+      bval_del(n);
+      return l;
+    }
+  }
+
+  bval_del(n);
+  return builtin_first(e, l);
+}
+
+
+// the value of the first element of l, which is taken over
+bval* builtin_first(benv* e, bval* l) {
+  if (BVAL_TYPE(l) == BVAL_QEXPR && l->count) {
+    bval* x = bval_eval(e, bval_retain(l->cell[0]));
+    bval_del(l);
+    return x;
+  }
+
+  bval* x = builtin_call(e, BOP_HEAD, 1, &l);
+  if (BVAL_TYPE(x) == BVAL_ERR) return x;
+  return builtin_call(e, BOP_EVAL, 1, &x);
+}
+
+
+bval* builtin_last(benv* e, int argc, bval** argv) {
+  bval* l = argv[0];
+
+  if (BVAL_TYPE(l) == BVAL_QEXPR && l->count) {
+    return bval_eval(e, bval_retain(l->cell[l->count - 1]));
+  }
+
+  bval* n = bval_retain(l);
+  n = builtin_call(e, BOP_LEN, 1, &n);
+  if (BVAL_TYPE(n) == BVAL_ERR) return n;
+
+  bval* args[2] = { n, bval_num(1) };
+  n = builtin_call(e, BOP_SUB, 2, args);
+  if (BVAL_TYPE(n) == BVAL_ERR) return n;
+
+  return builtin_nth_walk(e, n, bval_retain(l));
+}
+
+
+// number of elements of l, if n is a count of them that take or drop can
+// use directly, otherwise -1
+int builtin_count(bval* n, bval* l) {
+  if (BVAL_TYPE(n) != BVAL_NUM || BVAL_TYPE(l) != BVAL_QEXPR) return -1;
+  double k = bval_number(n);
+  return k >= 0 && k <= l->count && k == (int) k ? (int) k : -1;
+}
+
+
+bval* builtin_take(benv* e, int argc, bval** argv) {
+  bval* l = argv[1];
+  int k = builtin_count(argv[0], l);
+
+  if (BVAL_TYPE(l) == BVAL_SEQ && BVAL_TYPE(argv[0]) == BVAL_NUM) {
+    double n = bval_number(argv[0]);
+    if (n >= 0 && n == (long) n) {
+      return bval_seq(BSEQ_TAKE, bval_retain(l), NULL, (long) n);
+    }
+  }
+
+  // the first k elements, sharing the list's
+  if (k >= 0) return bval_slice(bval_retain(l), 0, k);
+
+  // step by step, keeping the heads to join once the end is reached
+  bval* n = bval_retain(argv[0]);
+  l = bval_retain(l);
+  bval* heads = bval_qexpr();
+  bval* err = NULL;
 
-  bval_del(a);
+  while (!err && (BVAL_TYPE(n) != BVAL_NUM || bval_number(n) != 0)) {
+    bval* h = bval_retain(l);
+    h = builtin_call(e, BOP_HEAD, 1, &h);
+    if (BVAL_TYPE(h) == BVAL_ERR) {
+      err = h;
+      break;
+    }
+    bval_add(heads, h);
+
+    bval* args[2] = { n, bval_num(1) };
+    n = builtin_call(e, BOP_SUB, 2, args);
+    if (BVAL_TYPE(n) == BVAL_ERR) {
+      err = n;
+      n = bval_num(0);
+      break;
+    }
+
+    l = builtin_call(e, BOP_TAIL, 1, &l);
+    if (BVAL_TYPE(l) == BVAL_ERR) err = l;
+  }
+
+  bval_del(n);
+  if (err) {
+    if (err != l) bval_del(l);
+    bval_del(heads);
+    return err;
+  }
+  bval_del(l);
+
+  bval* x = bval_qexpr();
+  while (heads->count) {
+    bval* args[2] = { bval_pop(heads, heads->count - 1), x };
+    x = builtin_call(e, BOP_JOIN, 2, args);
+    if (BVAL_TYPE(x) == BVAL_ERR) break;
+  }
+  bval_del(heads);
   return x;
 }
 
 
-bval* builtin_op(benv* e, bval* v, char* op) {
+bval* builtin_drop(benv* e, int argc, bval** argv) {
+  bval* l = argv[1];
+  int k = builtin_count(argv[0], l);
+
+  // the elements after the first k, sharing the list's
+  if (k >= 0) return bval_slice(bval_retain(l), k, l->count);
 
-  // currently can only accept number atoms
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type != BVAL_NUM) {
-      bval_del(v);
-      return bval_err("Cannot operate on non-number!");
+  // a string view from character k on
+  if (BVAL_TYPE(l) == BVAL_STR && BVAL_TYPE(argv[0]) == BVAL_NUM) {
+    double n = bval_number(argv[0]);
+    if (n >= 0 && n <= strlen(l->str) && n == (int) n) {
+      return bval_substr(bval_retain(l), (int) n);
     }
   }
 
-  bval* head = bval_pop(v, 0);
+  bval* n = bval_retain(argv[0]);
+  l = bval_retain(l);
 
-  // unary negation operator
-  if (strcmp(op, "-") == 0 && v->count == 0) {
-    head->num = - head->num;
+  while (BVAL_TYPE(n) != BVAL_NUM || bval_number(n) != 0) {
+    bval* args[2] = { n, bval_num(1) };
+    n = builtin_call(e, BOP_SUB, 2, args);
+    if (BVAL_TYPE(n) == BVAL_ERR) {
+      bval_del(l);
+      return n;
+    }
+
+    l = builtin_call(e, BOP_TAIL, 1, &l);
+    if (BVAL_TYPE(l) == BVAL_ERR) {
+      bval_del(n);
+      return l;
+    }
   }
 
-  while(v->count) {
-    bval* next = bval_pop(v, 0);
+  bval_del(n);
+  return l;
+}
 
-    if (strcmp(op, "+") == 0) head->num += next->num;
-    if (strcmp(op, "-") == 0) head->num -= next->num;
-    if (strcmp(op, "*") == 0) head->num *= next->num;
 
-    if (strcmp(op, "%") == 0) {
-      if (next->num == 0) {
-        bval_del(head);
-        bval_del(next);
-        return bval_err("Modulus by zero!");
-      }
-      head->num = fmod(head->num, next->num);
+bval* builtin_map(benv* e, int argc, bval** argv) {
+  bval* f = argv[0];
+  bval* l = argv[1];
+
+  if (BVAL_TYPE(l) == BVAL_SEQ) {
+    return bval_seq(BSEQ_MAP, bval_retain(l), bval_retain(f), 0);
+  }
+  if (BVAL_TYPE(l) != BVAL_QEXPR) return builtin_first(e, bval_retain(l));
+  if (l->count == 0) return bval_retain(l);
+
+  bval* x = bval_qexpr();
+  bval_room(x, l->count);
+
+  for (int i = 0; i < l->count; i++) {
+    bval* v = bval_eval(e, bval_retain(l->cell[i]));
+    if (BVAL_TYPE(v) != BVAL_ERR) v = bval_invoke(e, f, 1, &v);
+    if (BVAL_TYPE(v) == BVAL_ERR) {
+      bval_del(x);
+      return v;
     }
+    bval_add(x, v);
+  }
 
-    if (strcmp(op, "/") == 0) {
-      if (next->num == 0) {
-        bval_del(head);
-        bval_del(next);
-        return bval_err("Division by zero!");
-      }
-      head->num /= next->num;
+  return x;
+}
+
+
+bval* builtin_foldl(benv* e, int argc, bval** argv) {
+  bval* f = argv[0];
+  bval* l = argv[2];
+
+  if (BVAL_TYPE(l) == BVAL_SEQ) {
+    return bseq_reduce(e, l, BOP_FOLDL, f, bval_retain(argv[1]));
+  }
+  if (BVAL_TYPE(l) != BVAL_QEXPR) return builtin_first(e, bval_retain(l));
+
+  bval* acc = bval_retain(argv[1]);
+  for (int i = 0; i < l->count; i++) {
+    bval* v = bval_eval(e, bval_retain(l->cell[i]));
+    if (BVAL_TYPE(v) == BVAL_ERR) {
+      bval_del(acc);
+      return v;
     }
 
-    bval_del(next);
+    bval* args[2] = { acc, v };
+    acc = bval_invoke(e, f, 2, args);
+    if (BVAL_TYPE(acc) == BVAL_ERR) return acc;
   }
 
-  bval_del(v);
+  return acc;
+}
+
+
+// foldl of the arithmetic builtin op over l, from start
+bval* builtin_fold_op(benv* e, bval* l, int op, double start) {
+  if (BVAL_TYPE(l) == BVAL_SEQ) return bseq_reduce(e, l, op, NULL, bval_num(start));
+  if (BVAL_TYPE(l) != BVAL_QEXPR) return builtin_first(e, bval_retain(l));
 
-  return head;
+  double acc = start;
+  for (int i = 0; i < l->count; i++) {
+    bval* v = bval_eval(e, bval_retain(l->cell[i]));
+
+    if (BVAL_TYPE(v) != BVAL_NUM) {
+      if (BVAL_TYPE(v) == BVAL_ERR) return v;
+      bval* args[2] = { bval_num(acc), v };
+      return builtin_call(e, op, 2, args);
+    }
+
+    acc = op == BOP_ADD ? acc + bval_number(v) : acc * bval_number(v);
+    bval_del(v);
+  }
+
+  return bval_num(acc);
 }
 
 
-bval* builtin_not(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 1, "not");
-  ASSERT_ARG_TYPE(a, 0, BVAL_NUM, "not");
-  bval* x = bval_pop(a, 0);
+bval* builtin_sum(benv* e, int argc, bval** argv) {
+  return builtin_fold_name(e, argv[0], "+", BOP_ADD, 0);
+}
 
-  x->num = x->num
-    ? ((double) 0)
-    : ((double) 1);
 
-  bval_del(a);
+bval* builtin_product(benv* e, int argc, bval** argv) {
+  return builtin_fold_name(e, argv[0], "*", BOP_MUL, 1);
+}
+
+
+/**
+ * foldl of whatever name is bound to where the call is made over l, from
+ * start, as the prelude's (foldl + 0 l) was. While that is still the
+ * arithmetic builtin op the fold runs unboxed
+ */
+bval* builtin_fold_name(benv* e, bval* l, char* name, int op, double start) {
+  bval* k = bval_sym(name);
+  bval* f = benv_get(e, k);
+  bval_del(k);
+  if (BVAL_TYPE(f) == BVAL_ERR) return f;
+
+  if (BVAL_TYPE(f) == BVAL_FUN && BVAL_IS_BUILTIN(f) && f->info->op == op) {
+    bval_del(f);
+    return builtin_fold_op(e, l, op, start);
+  }
+
+  bval* args[3] = { f, bval_num(start), bval_retain(l) };
+  return builtin_call(e, BOP_FOLDL, 3, args);
+}
+
+
+bval* builtin_joins(benv* e, int argc, bval** argv) {
+  // on the heap, joins being given as many arguments as unpack can pass
+  bval** parts = malloc(sizeof(bval*) * (argc > 0 ? argc : 1));
+  size_t size = 0;
+
+  for (int i = 0; i < argc; i++) {
+    parts[i] = bval_to_string(argv[i]);
+    size += strlen(parts[i]->str);
+  }
+
+  char* str = malloc(size + 1);
+  char* end = str;
+  for (int i = 0; i < argc; i++) {
+    size_t n = strlen(parts[i]->str);
+    memcpy(end, parts[i]->str, n);
+    end += n;
+    bval_del(parts[i]);
+  }
+  *end = '\0';
+  free(parts);
+
+  bval* x = bval_str(str);
+  free(str);
   return x;
 }
 
 
-bval* builtin_if(benv* e, bval* a) {
-  ASSERT_ARG_LEN(a, 3, "if");
-  ASSERT_ARG_TYPE(a, 0, BVAL_NUM, "if");
-  ASSERT_ARG_TYPE(a, 1, BVAL_QEXPR, "if");
-  ASSERT_ARG_TYPE(a, 2, BVAL_QEXPR, "if");
+// (range to), (range from to) or (range from to step)
+bval* builtin_range(benv* e, int argc, bval** argv) {
+  double from = argc > 1 ? bval_number(argv[0]) : 0;
+  double to = bval_number(argv[argc > 1 ? 1 : 0]);
+  double step = argc > 2 ? bval_number(argv[2]) : 1;
+
+  ASSERT(step != 0, "Function 'range' passed a step of 0!");
+  return bval_range(from, to, step);
+}
 
-  // make args eval-able
-  a->cell[1]->type = BVAL_SEXPR;
-  a->cell[2]->type = BVAL_SEXPR;
 
-  bval* r = a->cell[0]->num
-    ? bval_eval(e, bval_pop(a, 1))
-    : bval_eval(e, bval_pop(a, 2));
+bval* builtin_filter(benv* e, int argc, bval** argv) {
+  return builtin_keep(e, argv[0], argv[1], BSEQ_FILTER);
+}
+
+
+bval* builtin_take_while(benv* e, int argc, bval** argv) {
+  return builtin_keep(e, argv[0], argv[1], BSEQ_TAKE_WHILE);
+}
+
+
+/**
+ * filter or take-while, by kind: lazily on a sequence, otherwise the
+ * elements of Q-expression l whose values pass f, up to the first that
+ * doesn't for take-while
+ */
+bval* builtin_keep(benv* e, bval* f, bval* l, int kind) {
+  if (BVAL_TYPE(l) == BVAL_SEQ) {
+    return bval_seq(kind, bval_retain(l), bval_retain(f), 0);
+  }
+  if (BVAL_TYPE(l) != BVAL_QEXPR) return builtin_first(e, bval_retain(l));
+
+  bval* x = bval_qexpr();
+  for (int i = 0; i < l->count; i++) {
+    bval* v = bval_eval(e, bval_retain(l->cell[i]));
+    int pass = 0;
+    bval* err = BVAL_TYPE(v) == BVAL_ERR
+      ? bval_retain(v)
+      : bseq_test(e, f, v, bseq_name(kind), &pass);
+    bval_del(v);
+
+    if (err) {
+      bval_del(x);
+      return err;
+    }
+    if (!pass && kind == BSEQ_TAKE_WHILE) break;
+    if (pass) bval_add(x, bval_retain(l->cell[i]));
+  }
+
+  return x;
+}
+
 
-  bval_del(a);
+// the elements of a sequence in a Q-expression
+bval* builtin_force(benv* e, int argc, bval** argv) {
+  if (BVAL_TYPE(argv[0]) == BVAL_QEXPR) return bval_claim(argv, 0);
+  ASSERT_ARG_TYPE(argv, 0, BVAL_SEQ, "force");
+  return bseq_reduce(e, argv[0], BOP_FORCE, NULL, bval_qexpr());
+}
+
+
+// the elements of a Q-expression as a sequence, to run map, filter and
+// take over it in one pass
+bval* builtin_seq(benv* e, int argc, bval** argv) {
+  return bval_seq(BSEQ_LIST, bval_claim(argv, 0), NULL, 0);
+}
+
+
+// call the builtin numbered op as a call from blisp would, on argc values
+// which it takes over
+bval* builtin_call(benv* e, int op, int argc, bval** argv) {
+  bbuiltin_info* b = builtin_table;
+  while (b->op != op) b++;
+
+  bval* r = bval_builtin_check(b, argc, argv);
+  if (!r) r = b->fn(e, argc, argv);
+  bval_release(argc, argv);
   return r;
 }
 
 
-bval* builtin_ord(benv* e, bval* a, char* op) {
-  ASSERT_ARG_LEN(a, 2, op);
-  ASSERT_ARG_TYPE(a, 0, BVAL_NUM, op);
-  ASSERT_ARG_TYPE(a, 1, BVAL_NUM, op);
+bval* builtin_op(benv* e, int argc, bval** argv, int op) {
+
+  // numbers are immediates, so accumulate unboxed and box once at the end
+  double head = bval_number(argv[0]);
+
+  // unary negation operator
+  if (op == BOP_SUB && argc == 1) {
+    head = - head;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    double next = bval_number(argv[i]);
+
+    switch (op) {
+      case BOP_ADD: head += next; break;
+      case BOP_SUB: head -= next; break;
+      case BOP_MUL: head *= next; break;
+
+      case BOP_MOD:
+        if (next == 0) return bval_err("Modulus by zero!");
+        head = fmod(head, next);
+        break;
+
+      case BOP_DIV:
+        if (next == 0) return bval_err("Division by zero!");
+        head /= next;
+        break;
+    }
+  }
+
+  return bval_num(head);
+}
+
+
+bval* builtin_not(benv* e, int argc, bval** argv) {
+  return bval_num(bval_number(argv[0])
+    ? ((double) 0)
+    : ((double) 1));
+}
 
-  int r;
-  double x = a->cell[0]->num;
-  double y = a->cell[1]->num;
 
-  if (strcmp(op, "<"))  r = (x < y);
-  if (strcmp(op, ">"))  r = (x > y);
-  if (strcmp(op, "<=")) r = (x <= y);
-  if (strcmp(op, ">=")) r = (x >= y);
+bval* builtin_if(benv* e, int argc, bval** argv) {
 
-  bval_del(a);
-  return bval_num(r);
+  bval* x = bval_claim(argv, bval_number(argv[0]) ? 1 : 2);
+
+  // make the chosen branch eval-able
+  x = bval_own(x);
+  x->type = BVAL_SEXPR;
+  return bval_eval(e, x);
 }
 
-bval* builtin_cmp(benv* e, bval* a, char* op) {
-  ASSERT_ARG_LEN(a, 2, op);
 
-  int r;
-  bval* x = a->cell[0];
-  bval* y = a->cell[1];
+bval* builtin_ord(benv* e, int argc, bval** argv, int op) {
+  double x = bval_number(argv[0]);
+  double y = bval_number(argv[1]);
 
-  if (strcmp(op, "=") == 0)   r =  bval_eq(x, y);
-  if (strcmp(op, "!=") == 0)  r = !bval_eq(x, y);
+  switch (op) {
+    case BOP_LT: return bval_num(x < y);
+    case BOP_GT: return bval_num(x > y);
+    case BOP_LE: return bval_num(x <= y);
+    default:     return bval_num(x >= y);
+  }
+}
 
-  bval_del(a);
-  return bval_num(r);
+bval* builtin_cmp(benv* e, int argc, bval** argv, int op) {
+  int r = bval_eq(argv[0], argv[1]);
+  return bval_num(op == BOP_EQ ? r : !r);
 }
@@ -1,45 +1,88 @@
+/**
+ * Node allocation: from the nursery while a form is running, otherwise from
+ * the long-lived pool
+ */
+bval* bval_alloc(void) {
+  bval* v;
+#ifndef BLISP_MALLOC
+  if (bval_arena.depth && !bval_arena.paused) {
+    v = barena_alloc(&bval_arena);
+    v->flags = BVAL_F_ARENA;
+    v->rc = 1;
+    return v;
+  }
+#endif
+  v = bpool_alloc(&bval_pool);
+  v->flags = 0;
+  v->rc = 1;
+  return v;
+}
+
+
+void bval_free(bval* v) {
+  if (v->flags & BVAL_F_ARENA) {
+    barena_free(&bval_arena, v);
+  } else {
+    bpool_free(&bval_pool, v);
+  }
+}
+
+
 /**
  * blisp AST node constructors
  */
 bval* bval_num(double num) {
-  bval* v = malloc(sizeof(bval));
+#ifdef BLISP_BOXED_NUMS
+  bval* v = bval_alloc();
   v->type = BVAL_NUM;
   v->num = num;
   return v;
+#else
+  uint64_t bits;
+  // collapse every NaN onto one pattern so the offset can't overflow
+  if (num != num) num = NAN;
+  memcpy(&bits, &num, sizeof(bits));
+  return (bval*) (uintptr_t) (bits + BVAL_NUM_OFFSET);
+#endif
 }
 bval* bval_sym(char* sym) {
-  bval* v = malloc(sizeof(bval));
+  bval* v = bval_alloc();
   v->type = BVAL_SYM;
-  // allocate memory size = length of string + 1 for null terminator
-  v->sym = malloc(strlen(sym) + 1);
-  strcpy(v->sym, sym);
+  v->sym = bsym_intern(sym);
+  v->depth = 0;
+  v->slot = -1;
+  v->inlined = NULL;
   return v;
 }
 bval* bval_sexpr(void) {
-  bval* v = malloc(sizeof(bval));
+  bval* v = bval_alloc();
   v->type = BVAL_SEXPR;
   v->count = 0;
+  v->start = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
 bval* bval_qexpr(void) {
-  bval* v = malloc(sizeof(bval));
+  bval* v = bval_alloc();
   v->type = BVAL_QEXPR;
   v->count = 0;
+  v->start = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
-bval* bval_fun(bbuiltin fn, char* name) {
-  bval* v = malloc(sizeof(bval));
+bval* bval_fun(bbuiltin_info* info) {
+  bval* v = bval_alloc();
   v->type = BVAL_FUN;
-  v->builtin = fn;
-  v->sym = name;
+  v->flags |= BVAL_F_BUILTIN;
+  v->builtin = info->fn;
+  v->info = info;
   return v;
 }
 bval* bval_lambda(bval* formals, bval* body) {
-  bval* v = malloc(sizeof(bval));
+  bval* v = bval_alloc();
   v->type = BVAL_FUN;
-  v->builtin = NULL;
 
   // new scope for function
   v->env = benv_new();
@@ -48,34 +91,86 @@ bval* bval_lambda(bval* formals, bval* body) {
   v->body = body;
   return v;
 }
+bval* bval_range(double from, double to, double step) {
+  bval* v = bval_alloc();
+  v->type = BVAL_SEQ;
+  v->kind = BSEQ_RANGE;
+  v->from = from;
+  v->to = to;
+  v->step = step;
+  return v;
+}
+bval* bval_seq(int kind, bval* src, bval* fn, long left) {
+  bval* v = bval_alloc();
+  v->type = BVAL_SEQ;
+  v->kind = kind;
+  v->src = src;
+  v->fn = fn;
+  v->left = left;
+  return v;
+}
 bval* bval_str(char* str) {
-  bval* v = malloc(sizeof(bval));
+  bval* v = bval_alloc();
   v->type = BVAL_STR;
-  v->str = malloc(strlen(str) + 1);
-  strcpy(v->str, str);
+  v->str = bmem_strdup(BVAL_IS_YOUNG(v), str);
+  v->base = NULL;
   return v;
 }
+
+
+/**
+ * String s, which is taken over, from character k on. The characters are
+ * shared rather than copied: the result is a view of the string owning
+ * them, which copies them only once it is changed (see bval_own)
+ */
+bval* bval_substr(bval* s, int k) {
+  if (s->rc == 1 && s->base) {
+    s->str += k;
+    return s;
+  }
+
+  bval* base = s->base ? s->base : s;
+  bval* x = bval_alloc();
+  x->type = BVAL_STR;
+
+  // only a string of the same age, see bvec.c
+  if (BVAL_IS_YOUNG(x) == BVAL_IS_YOUNG(base)) {
+    x->str = s->str + k;
+    x->base = bval_retain(base);
+  } else {
+    x->str = bmem_strdup(BVAL_IS_YOUNG(x), s->str + k);
+    x->base = NULL;
+  }
+
+  bval_del(s);
+  return x;
+}
 bval* bval_ok(void) {
-  bval* v = malloc(sizeof(bval));
-  v->type = BVAL_OK;
-  return v;
+  return BVAL_OK_HANDLE;
+}
+double bval_number(bval* v) {
+#ifdef BLISP_BOXED_NUMS
+  return v->num;
+#else
+  double num;
+  uint64_t bits = ((uint64_t) (uintptr_t) v) - BVAL_NUM_OFFSET;
+  memcpy(&num, &bits, sizeof(num));
+  return num;
+#endif
 }
 // veriadic error message function
 bval* bval_err(char* fmt, ...) {
-  bval* v = malloc(sizeof(bval));
+  bval* v = bval_alloc();
   v->type = BVAL_ERR;
 
   // create varargs list
   va_list va;
   va_start(va, fmt);
 
-  v->err = malloc(512);
-
-  // printf with fmt and arguments
-  vsnprintf(v->err, 511, fmt, va);
-
-  // shrink error memory to size used
-  v->err = realloc(v->err, strlen(v->err) + 1);
+  // printf with fmt and arguments, then keep only the size used
+  char buffer[512];
+  vsnprintf(buffer, 511, fmt, va);
+  v->err = bmem_strdup(BVAL_IS_YOUNG(v), buffer);
 
   va_end(va);
 
@@ -83,13 +178,23 @@ bval* bval_err(char* fmt, ...) {
 }
 
 bval* bval_take(bval* v, int i) {
-  bval* x = bval_pop(v, i);
+  // v may be shared, so take a reference rather than popping
+  bval* x = bval_retain(v->cell[i]);
   bval_del(v);
   return x;
 }
 
 
 bval* bval_pop(bval* v, int i) {
+  // the first or last element just narrows the slice, v being owned by the
+  // caller so it stays the same node
+  if (i == 0 || i == v->count - 1) {
+    bval* x = bval_retain(v->cell[i]);
+    bval_slice(v, i == 0, v->count - (i != 0));
+    return x;
+  }
+
+  bval_unshare(v);
   bval* x = v->cell[i];
 
   memmove(
@@ -98,109 +203,355 @@ bval* bval_pop(bval* v, int i) {
     sizeof(bval*) * (v->count - i - 1)
   );
 
+  BVEC(v)->back--;
   v->count--;
-  v->cell = realloc(v->cell, sizeof(bval*) * v->count);
 
   return x;
 }
 
 
 bval* bval_join(bval* x, bval* y) {
-  // append children of y onto children of x
-  while (y->count) x = bval_add(x, bval_pop(y, 0));
+  // append children of y onto children of x in one go, moving them over
+  // when y was the only one holding them, sharing them with y otherwise
+  if (y->count) {
+    bval_room(x, y->count);
+    bvec* b = BVEC(x);
+
+    if (y->rc == 1 && bvec_owned(y)) {
+      memcpy(&b->cell[b->back], y->cell, sizeof(bval*) * y->count);
+      b->back += y->count;
+      x->count += y->count;
+      bval_clear(y);
+    } else {
+      for (int i = 0; i < y->count; i++) {
+        b->cell[b->back++] = bval_retain(y->cell[i]);
+      }
+      x->count += y->count;
+    }
+  }
   bval_del(y);
   return x;
 }
 
 
 /**
- * Call a function in an environment, with arguments
+ * Lexical addressing
+ *
+ * A call frame binds the formals in order, so inside a lambda body a
+ * reference to formal n is slot n of the innermost scope. When a lambda is
+ * built, bval_resolve records that on the symbols of its body. Inside a
+ * nested lambda literal the outer formals are recorded one scope further
+ * out, which is where they are when the literal is applied on the spot.
+ *
+ * Scoping is dynamic, so a resolution is only a hint: benv_get checks it
+ * before using it, and re-resolves the symbol to wherever a lookup found
+ * it otherwise.
+ */
+// frame slot a formal is bound to, or -1
+int bval_formal_slot(bval* formals, char* sym) {
+  int slot = 0;
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->sym == bsym_varargs) continue;
+    if (formals->cell[i]->sym == sym) return slot;
+    slot++;
+  }
+  return -1;
+}
+
+
+// (\ {formals} {body}), spelled with the builtin or the prelude alias
+int bval_is_lambda_literal(bval* v) {
+  if (BVAL_TYPE(v) != BVAL_SEXPR || v->count != 3) return 0;
+
+  bval* head = v->cell[0];
+  if (BVAL_TYPE(head) != BVAL_SYM) return 0;
+  if (head->sym != bsym_lambda && head->sym != bsym_fn) return 0;
+
+  return BVAL_TYPE(v->cell[1]) == BVAL_QEXPR
+    && BVAL_TYPE(v->cell[2]) == BVAL_QEXPR;
+}
+
+
+void bval_resolve(bval* v, bscope* scope) {
+  switch (BVAL_TYPE(v)) {
+    case BVAL_SYM: {
+      int depth = 0;
+      for (bscope* s = scope; s; s = s->outer, depth++) {
+        int slot = bval_formal_slot(s->formals, v->sym);
+        if (slot >= 0) {
+          v->depth = depth;
+          v->slot = slot;
+          return;
+        }
+      }
+      break;
+    }
+
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      if (bval_is_lambda_literal(v)) {
+        bscope inner = { v->cell[1], scope };
+        bval_resolve(v->cell[2], &inner);
+        break;
+      }
+      for (int i = 0; i < v->count; i++) bval_resolve(v->cell[i], scope);
+      break;
+  }
+}
+
+
+/**
+ * Call a function in an environment, with argc argument values, which the
+ * call takes over
  */
-bval* bval_call(benv* e, bval* f, bval* a) {
-  if (f->builtin) return f->builtin(e, a);
+bval* bval_call(benv* e, bval* f, int argc, bval** argv) {
+  if (BVAL_IS_BUILTIN(f)) return bval_builtin(e, f, argc, argv);
+
+  bval* r = NULL;
+  benv* frame = bval_bind(e, f, argc, argv, &r);
+  if (!frame) return r;
+
+  frame->parent = e;
+
+  // evaluate the body of the function in the frame, as compiled code
+  // unless the tree walker was asked for; either way the frame is handed
+  // over
+  if (bvm_enabled) return bvm_exec(frame, f->body);
+  if (bclo_enabled) return bclo_exec(frame, f->body);
 
-  int given = a->count;
-  int total = f->formals->count;
+  bval* body = bval_copy(f->body);
+  body->type = BVAL_SEXPR;
+  return bval_eval_frame(frame, body, 1);
+}
 
-  while (a->count) {
 
-    if (f->formals->count == 0) {
-      bval_del(a);
-      return bval_err(
+/**
+ * Call f on argc argument values, which the call takes over, as
+ * evaluating an S-expression of f and the values would
+ */
+bval* bval_invoke(benv* e, bval* f, int argc, bval** argv) {
+  if (BVAL_TYPE(f) != BVAL_FUN) {
+    bval_release(argc, argv);
+    return bval_err(
+      "S-expression starts with incorrect type!"
+      "Given type %s, Expected type %s",
+      btype_name(BVAL_TYPE(f)), btype_name(BVAL_FUN)
+    );
+  }
+  return bval_call(e, f, argc, argv);
+}
+
+
+/**
+ * A builtin given fewer arguments than it needs, where it stands in for a
+ * prelude function (curry set), returns a lambda taking the rest, as the
+ * lambda would have
+ */
+bval* bval_partial(bval* f, int argc, bval** argv) {
+  bval* g = bval_lambda(bval_qexpr(), bval_add(bval_qexpr(), bval_retain(f)));
+
+  for (int i = 0; i < f->info->min; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "_%i", i);
+    bval* sym = bval_sym(name);
+
+    bval_add(g->body, bval_retain(sym));
+    if (i < argc) {
+      benv_put(g->env, sym, argv[i]);
+    } else {
+      bval_add(g->formals, bval_retain(sym));
+    }
+    bval_del(sym);
+  }
+
+  bval_release(argc, argv);
+  return g;
+}
+
+
+/**
+ * Call the builtin f with argc argument values, which the call takes over,
+ * once they match the arity and types in its table entry. An old-style
+ * builtin is handed them as an S-expression
+ */
+bval* bval_builtin(benv* e, bval* f, int argc, bval** argv) {
+  bbuiltin_info* b = f->info;
+  if (b->curry && argc < b->min) return bval_partial(f, argc, argv);
+
+  bval* r = bval_builtin_check(b, argc, argv);
+
+  if (!r && b->sexpr) {
+    bval* a = bval_sexpr();
+    if (argc) bval_room(a, argc);
+    for (int i = 0; i < argc; i++) {
+      bval_add(a, argv[i]);
+    }
+    return b->sexpr(e, a);
+  }
+
+  if (!r) r = b->fn(e, argc, argv);
+  bval_release(argc, argv);
+  return r;
+}
+
+
+// the error for arguments not matching the table entry b, or NULL
+bval* bval_builtin_check(bbuiltin_info* b, int argc, bval** argv) {
+  if (argc < b->min || (b->max >= 0 && argc > b->max)) {
+    if (b->min == b->max) {
+      return bval_err("Function '%s' given %i arguments, expected %i",
+        b->name, argc, b->min);
+    }
+    if (b->max >= 0 && argc > b->max) {
+      return bval_err("Function '%s' given %i arguments, expected at most %i",
+        b->name, argc, b->max);
+    }
+    return bval_err("Function '%s' given %i arguments, expected at least %i",
+      b->name, argc, b->min);
+  }
+
+  for (int i = 0; i < argc; i++) {
+    int mask = i < BBUILTIN_ARGS ? b->args[i] : b->rest;
+    int type = BVAL_TYPE(argv[i]);
+    if (!mask || (mask & BTYPE(type))) continue;
+
+    int expected = 0;
+    while (!(mask & BTYPE(expected))) expected++;
+    return bval_err("Function '%s' needs type %s as argument %i, given type %s!",
+      b->name, btype_name(expected), i, btype_name(type));
+  }
+
+  return NULL;
+}
+
+
+// take over argument i of a builtin, so the caller doesn't release it
+bval* bval_claim(bval** argv, int i) {
+  bval* x = argv[i];
+  argv[i] = NULL;
+  return x;
+}
+
+
+// call fn on the elements of a fresh list a, which is taken over and
+// stays live while fn runs (load collects between forms)
+bval* bval_apply(benv* e, bbuiltin fn, bval* a) {
+  bgc_push(a);
+  bval* r = fn(e, a->count, a->cell);
+  bgc_pop();
+  bval_release(a->count, a->cell);
+  bval_clear(a);
+  bval_del(a);
+  return r;
+}
+
+
+// release the arguments of a call, other than those claimed
+void bval_release(int argc, bval** argv) {
+  for (int i = 0; i < argc; i++) {
+    if (argv[i]) bval_del(argv[i]);
+  }
+}
+
+
+/**
+ * Bind the argc argument values argv, which are taken over, to the formals
+ * of lambda f in a fresh frame. If every formal is bound the frame is
+ * returned (without a parent), otherwise NULL is returned and r set to the
+ * error or the curried function
+ */
+benv* bval_bind(benv* e, bval* f, int argc, bval** argv, bval** r) {
+  if (f->flags & BVAL_F_MACRO) {
+    *r = bmac_call(e, f, argc, argv);
+    return NULL;
+  }
+
+  bval* formals = f->formals;
+  int total = formals->count;
+
+  // index of the next formal to bind
+  int i = 0;
+
+  // bind arguments in a fresh frame so f itself stays shareable
+  benv* frame = benv_copy(f->env);
+
+  for (int k = 0; k < argc; k++) {
+
+    if (i == formals->count) {
+      bval_release(argc - k, &argv[k]);
+      benv_del(frame);
+      *r = bval_err(
         "Function passed too many arguments. "
         "Expected %i, Got %i.",
-        total, given
+        total, argc
       );
+      return NULL;
     }
 
-    bval* sym = bval_pop(f->formals, 0);
+    bval* sym = formals->cell[i++];
 
     // syntax for allowing remainder args
-    if (strcmp(sym->sym, "::") == 0) {
+    if (sym->sym == bsym_varargs) {
 
-      if (f->formals->count != 1) {
-        bval_del(a);
-        return bval_err(
+      if (formals->count - i != 1) {
+        bval_release(argc - k, &argv[k]);
+        benv_del(frame);
+        *r = bval_err(
           "Function format invalid."
           "Symbol '::' not followed by single symbol."
         );
+        return NULL;
       }
 
-      bval* nsym = bval_pop(f->formals, 0);
-      benv_put(f->env, nsym, builtin_list(e, a));
-      bval_del(sym);
-      bval_del(nsym);
+      bval* nsym = formals->cell[i++];
+      bval* rest = builtin_list(e, argc - k, &argv[k]);
+      benv_put(frame, nsym, rest);
+      bval_del(rest);
       break;
     }
 
-    bval* val = bval_pop(a, 0);
-
-    // bind a copy of the val to the functions environment
-    benv_put(f->env, sym, val);
-
-    bval_del(sym);
-    bval_del(val);
+    // bind the val to the frame
+    benv_put(frame, sym, argv[k]);
+    bval_del(argv[k]);
   }
 
-  // deallocate arglist
-  bval_del(a);
+  if (i < formals->count && formals->cell[i]->sym == bsym_varargs) {
 
-  if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "::") == 0) {
-
-    if (f->formals->count != 2) {
-      return bval_err(
+    if (formals->count - i != 2) {
+      benv_del(frame);
+      *r = bval_err(
         "Function format invalid."
         "Symbol '::' not followed by single symbol."
       );
+      return NULL;
     }
 
-    bval_del(bval_pop(f->formals, 0));
-
     // no remaining args for vararg list, assign empty list
-    bval* sym = bval_pop(f->formals, 0);
+    bval* sym = formals->cell[i + 1];
     bval* val = bval_qexpr();
-    benv_put(f->env, sym, val);
-    bval_del(sym);
+    benv_put(frame, sym, val);
     bval_del(val);
+    i += 2;
   }
 
 
-  // if all the functions parameters have been bound to arguments,
-  // evaluate the function and return a result
-  if (f->formals->count == 0) {
-
-    f->env->parent = e;
+  // if all the functions parameters have been bound to arguments the
+  // frame is ready for the body
+  if (i == formals->count) return frame;
 
-    // evaluate the body of the function
-    return builtin_eval(f->env,
-      // copy the q-expression representing the function body into an s-expression,
-      // using the environment of the function as context (with the newly found variables)
-      bval_add(bval_sexpr(), bval_copy(f->body))
-    );
-  } else {
-    // otherwise... curry the function
-    return bval_copy(f);
+  // otherwise... curry the function over the remaining formals
+  bval* rest = bval_qexpr();
+  for (; i < formals->count; i++) {
+    bval_add(rest, bval_retain(formals->cell[i]));
   }
+
+  bval* g = bval_alloc();
+  g->type = BVAL_FUN;
+  g->env = frame;
+  g->formals = rest;
+  g->body = bval_retain(f->body);
+  *r = g;
+  return NULL;
 }
 
 
@@ -209,34 +560,51 @@ bval* bval_call(benv* e, bval* f, bval* a) {
  */
 void bval_del(bval* v) {
 
-  switch (v->type) {
+  // immediates own no memory
+  if (BVAL_IS_IMM(v)) return;
+
+  // drop a reference, only the last one frees
+  if (--v->rc > 0) return;
+
+  switch (BVAL_TYPE(v)) {
     case BVAL_OK:
     case BVAL_NUM: break; // no property pointers for BVAL_NUM
 
-    case BVAL_ERR: free(v->err); break;
-    case BVAL_SYM: free(v->sym); break;
-    case BVAL_STR: free(v->str); break;
+    case BVAL_ERR: bmem_free(v->err); break;
+    case BVAL_SYM: bvm_free(v->inlined); break; // names are interned
+    case BVAL_STR:
+      if (v->base) {
+        bval_del(v->base);
+      } else {
+        bmem_free(v->str);
+      }
+      break;
 
     case BVAL_QEXPR:
     case BVAL_SEXPR:
-      // deallocate child nodes
-      for (int i = 0; i < v->count; i++) {
-        bval_del(v->cell[i]);
-      }
-      free(v->cell);
+      // let go of the child nodes
+      if (v->cell) bvec_release(BVEC(v));
+      bvm_free(v->code);
       break;
 
     case BVAL_FUN:
-      if (!v->builtin) {
+      if (!BVAL_IS_BUILTIN(v)) {
         benv_del(v->env);
         bval_del(v->formals);
         bval_del(v->body);
       }
       break;
+
+    case BVAL_SEQ:
+      if (v->kind != BSEQ_RANGE) {
+        bval_del(v->src);
+        if (v->fn) bval_del(v->fn);
+      }
+      break;
   }
 
   // deallocate pointer to bval struct itself
-  free(v);
+  bval_free(v);
 }
 
 
@@ -256,9 +624,9 @@ bval* bval_read_num(mpc_ast_t* tree) {
  * Add child node to parent
  */
 bval* bval_add(bval* parent, bval* child) {
+  bval_room(parent, 1);
+  BVEC(parent)->cell[BVEC(parent)->back++] = child;
   parent->count++;
-  parent->cell = realloc(parent->cell, sizeof(bval*) * parent->count);
-  parent->cell[parent->count - 1] = child;
   return parent;
 }
 
@@ -298,38 +666,50 @@ bval* bval_read(mpc_ast_t* tree) {
   if (strstr(tree->tag, "sexpr"))  x = bval_sexpr();
   if (strstr(tree->tag, "qexpr"))  x = bval_qexpr();
 
-  // fill out children of x
+  // reserve the children of x, then fill them out
+  int count = 0;
   for (int i = 0; i < tree->children_num; i++) {
-    mpc_ast_t* child = tree->children[i];
-
-    if (strcmp(child->contents, "(") == 0) continue;
-    if (strcmp(child->contents, ")") == 0) continue;
-    if (strcmp(child->contents, "{") == 0) continue;
-    if (strcmp(child->contents, "}") == 0) continue;
-    if (strcmp(child->tag, "regex")  == 0) continue;
-    if (strstr(child->tag, "comment"))     continue;
+    if (bval_read_child(tree->children[i])) count++;
+  }
+  if (count) bval_room(x, count);
 
-    x = bval_add(x, bval_read(child));
+  for (int i = 0; i < tree->children_num; i++) {
+    mpc_ast_t* child = tree->children[i];
+    if (bval_read_child(child)) x = bval_add(x, bval_read(child));
   }
 
   return x;
 }
 
 
+// whether a node of the AST is a child expression rather than a bracket,
+// the start and end of input or a comment
+int bval_read_child(mpc_ast_t* child) {
+  if (strcmp(child->contents, "(") == 0) return 0;
+  if (strcmp(child->contents, ")") == 0) return 0;
+  if (strcmp(child->contents, "{") == 0) return 0;
+  if (strcmp(child->contents, "}") == 0) return 0;
+  if (strcmp(child->tag, "regex")  == 0) return 0;
+  if (strstr(child->tag, "comment"))     return 0;
+  return 1;
+}
+
+
 int bval_eq(bval* x, bval* y) {
 
-  if (x->type != y->type) return 0;
+  if (BVAL_TYPE(x) != BVAL_TYPE(y)) return 0;
 
-  switch (x->type) {
+  switch (BVAL_TYPE(x)) {
     case BVAL_OK:  return 0;
-    case BVAL_NUM: return x->num == y->num;
+    case BVAL_NUM: return bval_number(x) == bval_number(y);
     case BVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case BVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+    case BVAL_SYM: return x->sym == y->sym;
     case BVAL_STR: return (strcmp(x->str, y->str) == 0);
 
     case BVAL_FUN:
-      if (x->builtin || y->builtin) {
-        return x->builtin == y->builtin;
+      if (BVAL_IS_BUILTIN(x) || BVAL_IS_BUILTIN(y)) {
+        return BVAL_IS_BUILTIN(x) && BVAL_IS_BUILTIN(y) &&
+          x->info == y->info;
       } else {
         return (
           bval_eq(x->formals, y->formals) &&
@@ -344,6 +724,15 @@ int bval_eq(bval* x, bval* y) {
         if (!bval_eq(x->cell[i], y->cell[i])) return 0;
       }
       return 1;
+
+    // sequences built the same way
+    case BVAL_SEQ:
+      if (x->kind != y->kind) return 0;
+      if (x->kind == BSEQ_RANGE) {
+        return x->from == y->from && x->to == y->to && x->step == y->step;
+      }
+      return bval_eq(x->src, y->src) && x->left == y->left &&
+        (x->fn && y->fn ? bval_eq(x->fn, y->fn) : x->fn == y->fn);
   }
 
   return 0;
@@ -354,90 +743,375 @@ int bval_eq(bval* x, bval* y) {
  * Transform sexpr for evaluation
  */
 bval* bval_eval(benv* e, bval* v) {
-  if (v->type == BVAL_SYM) {
+  if (BVAL_TYPE(v) == BVAL_SYM) {
     bval* x = benv_get(e, v);
     bval_del(v);
     return x;
   }
 
-  if (v->type == BVAL_SEXPR) return bval_eval_sexpr(e, v);
+  if (BVAL_TYPE(v) == BVAL_SEXPR) {
+    bval* x = bopt_value(v);
+    if (x) {
+      bval_del(v);
+      return x;
+    }
+    return bval_eval_sexpr(e, v);
+  }
   return v;
 }
 
 bval* bval_eval_sexpr(benv* e, bval* v) {
+  return bval_eval_frame(e, v, 0);
+}
 
-  // eval children first
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = bval_eval(e, v->cell[i]);
-    if (v->cell[i]->type == BVAL_ERR) return bval_take(v, i);
+
+/**
+ * If argv are valid arguments for the builtin if or eval, claim and return
+ * the Q-expression the builtin would go on to evaluate, so the caller can
+ * evaluate it in tail position. Otherwise return NULL
+ */
+bval* bval_tail_expr(bval* f, int argc, bval** argv) {
+  if (f->info->op == BOP_IF) {
+    if (argc != 3
+        || BVAL_TYPE(argv[0]) != BVAL_NUM
+        || BVAL_TYPE(argv[1]) != BVAL_QEXPR
+        || BVAL_TYPE(argv[2]) != BVAL_QEXPR) return NULL;
+    return bval_claim(argv, bval_number(argv[0]) ? 1 : 2);
   }
 
-  if (v->count == 0) return v;
-  if (v->count == 1) return bval_take(v, 0);
+  if (f->info->op == BOP_EVAL) {
+    if (argc != 1 || BVAL_TYPE(argv[0]) != BVAL_QEXPR) return NULL;
+    return bval_claim(argv, 0);
+  }
 
-  bval* f = bval_pop(v, 0);
-  if (f->type != BVAL_FUN) {
-    bval* err = bval_err(
-      "S-expression starts with incorrect type!"
-      "Given type %s, Expected type %s",
-      btype_name(f->type), btype_name(BVAL_FUN)
-    );
-    bval_del(f);
+  return NULL;
+}
+
+
+/**
+ * Evaluate an S-expression. The call giving the expression its value is
+ * a tail call: the branch chosen by if, the expression given to eval, the
+ * body of a lambda and the lone element of an S-expression are evaluated
+ * by this loop rather than by recursion, so tail recursion runs in
+ * constant C stack. With owned set, e is a call frame which this
+ * evaluation deletes when done
+ */
+bval* bval_eval_frame(benv* e, bval* v, int owned) {
+  bval* r = NULL;
+
+  while (!r) {
+    bgc_safepoint(e);
+
+    // a lone S-expression has the value of the one it holds, so that one is
+    // evaluated in its place, keeping a call wrapped by eval {(f x)} a tail
+    // call
+    if (v->count == 1 && BVAL_TYPE(v->cell[0]) == BVAL_SEXPR) {
+      v = bval_take(v, 0);
+      r = bopt_value(v);
+      if (r) bval_del(v);
+      continue;
+    }
+
+    // children are replaced in place
+    v = bval_own(v);
+
+    // eval children first, but the arguments of a macro are its forms
+    for (int i = 0; !r && i < v->count; i++) {
+      // the element is handed over, so the slot holds an immediate while
+      // it runs, or a collection meanwhile would follow it (see bgc.c)
+      bval* x = v->cell[i];
+      v->cell[i] = BVAL_OK_HANDLE;
+      v->cell[i] = bval_eval(e, x);
+      if (BVAL_TYPE(v->cell[i]) == BVAL_ERR) r = bval_take(v, i);
+      if (i == 0 && !r && bmac_applies(v->cell[0], v->count - 1)) break;
+    }
+    if (r) break;
+
+    // a macro call is replaced by its rewrite, evaluated in its place
+    if (v->count && bmac_applies(v->cell[0], v->count - 1)) {
+      bval* x = bmac_rewrite(bval_retain(v->cell[0]), v);
+      bval_del(v);
+      v = x;
+      continue;
+    }
+
+    if (v->count == 0) { r = v; break; }
+    if (v->count == 1) { r = bval_take(v, 0); break; }
+
+    // the head and arguments are used in place, then v is dropped
+    bval* f = v->cell[0];
+    int argc = v->count - 1;
+    bval** argv = &v->cell[1];
+
+    if (BVAL_TYPE(f) != BVAL_FUN) {
+      r = bval_err(
+        "S-expression starts with incorrect type!"
+        "Given type %s, Expected type %s",
+        btype_name(BVAL_TYPE(f)), btype_name(BVAL_FUN)
+      );
+      bval_del(v);
+      break;
+    }
+
+    bval_clear(v);
+
+    if (BVAL_IS_BUILTIN(f)) {
+      bval* x = bval_tail_expr(f, argc, argv);
+      if (x) {
+        bval_release(argc, argv);
+        bval_del(v);
+        v = bval_own(x);
+        v->type = BVAL_SEXPR;
+      } else {
+        r = bval_builtin(e, f, argc, argv);
+        bval_del(v);
+      }
+      bval_del(f);
+      continue;
+    }
+
+    benv* frame = bval_bind(e, f, argc, argv, &r);
     bval_del(v);
-    return err;
+    if (!frame) {
+      bval_del(f);
+      break;
+    }
+
+    // the callee's frame replaces the one this loop owns
+    frame->parent = e;
+    if (owned) benv_splice(frame, e);
+    e = frame;
+    owned = 1;
+
+    if (bvm_enabled || bclo_enabled) {
+      r = bvm_enabled ? bvm_exec(e, f->body) : bclo_exec(e, f->body);
+      bval_del(f);
+      return r;
+    }
+
+    v = bval_copy(f->body);
+    v->type = BVAL_SEXPR;
+    bval_del(f);
   }
 
-  bval* result = bval_call(e, f, v);
-  bval_del(f);
-  return result;
+  if (owned) benv_del(e);
+  return r;
 }
 
 
+/**
+ * Shallow copy: a fresh node whose children are shared with v, an
+ * expression viewing the same element block (see bvec.c)
+ */
 bval* bval_copy(bval* v) {
-  bval* x = malloc(sizeof(bval));
-  x->type = v->type;
+  if (BVAL_IS_IMM(v)) return v;
 
-  switch (v->type) {
+  bval* x = bval_alloc();
+  x->type = BVAL_TYPE(v);
+  x->flags |= v->flags & (BVAL_F_BUILTIN | BVAL_F_MACRO);
+  x->kind = v->kind;
+
+  switch (BVAL_TYPE(v)) {
     case BVAL_FUN:
-      if (v->builtin) {
-        x->sym = v->sym;
+      if (BVAL_IS_BUILTIN(v)) {
         x->builtin = v->builtin;
+        x->info = v->info;
       } else {
-        x->builtin = NULL;
         x->env = benv_copy(v->env);
-        x->formals = bval_copy(v->formals);
-        x->body = bval_copy(v->body);
+        x->formals = bval_retain(v->formals);
+        x->body = bval_retain(v->body);
       }
       break;
 
+#ifdef BLISP_BOXED_NUMS
     case BVAL_NUM: x->num = v->num; break;
-    case BVAL_OK: break;
+#endif
 
     case BVAL_ERR:
-      x->err = malloc(strlen(v->err) + 1);
-      strcpy(x->err, v->err);
+      x->err = bmem_strdup(BVAL_IS_YOUNG(x), v->err);
       break;
 
     case BVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym);
+      x->sym = v->sym;
+      x->depth = v->depth;
+      x->slot = v->slot;
+      x->inlined = NULL;
       break;
 
     case BVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str);
+      x->str = bmem_strdup(BVAL_IS_YOUNG(x), v->str);
+      x->base = NULL;
+      break;
+
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      x->count = 0;
+      x->start = 0;
+      x->cell = NULL;
+      x->code = NULL;
+      if (!v->cell) break;
+
+      // the same slice of v's block, when it is of x's age
+      if (BVEC(v)->young == BVAL_IS_YOUNG(x)) {
+        BVEC(v)->rc++;
+        bval_view(x, BVEC(v), v->start, v->count);
+      } else {
+        bvec* b = bvec_from(BVAL_IS_YOUNG(x), v->cell, v->count, 0, 0);
+        bval_view(x, b, 0, v->count);
+      }
       break;
 
+    case BVAL_SEQ:
+      if (v->kind == BSEQ_RANGE) {
+        x->from = v->from;
+        x->to = v->to;
+        x->step = v->step;
+      } else {
+        x->src = bval_retain(v->src);
+        x->fn = v->fn ? bval_retain(v->fn) : NULL;
+        x->left = v->left;
+      }
+      break;
+  }
+
+  return x;
+}
+
+
+bval* bval_retain(bval* v) {
+  if (!BVAL_IS_IMM(v)) v->rc++;
+  return v;
+}
+
+
+/**
+ * Copy on write: return a node the caller may mutate in place, copying v
+ * if anyone else holds a reference to it, and the elements of an
+ * expression if its block is shared
+ */
+bval* bval_own(bval* v) {
+  if (BVAL_IS_IMM(v)) return v;
+
+  if (v->rc == 1) {
+    // about to change, so compiled code for it goes stale
+    if (BVAL_TYPE(v) == BVAL_QEXPR || BVAL_TYPE(v) == BVAL_SEXPR) {
+      bvm_free(v->code);
+      v->code = NULL;
+      bval_unshare(v);
+    }
+    // a string view gets characters of its own
+    if (BVAL_TYPE(v) == BVAL_STR && v->base) {
+      v->str = bmem_strdup(BVAL_IS_YOUNG(v), v->str);
+      bval_del(v->base);
+      v->base = NULL;
+    }
+    return v;
+  }
+
+  bval* x = bval_copy(v);
+  bval_del(v);
+  if (BVAL_TYPE(x) == BVAL_QEXPR || BVAL_TYPE(x) == BVAL_SEXPR) {
+    bval_unshare(x);
+  }
+  return x;
+}
+
+
+// does v, or anything reachable from it, live in the form arena
+int bval_in_arena(bval* v) {
+#ifdef BLISP_MALLOC
+  return 0;
+#else
+  if (BVAL_IS_IMM(v)) return 0;
+  if (v->flags & BVAL_F_ARENA) return 1;
+
+  switch (v->type) {
+    case BVAL_SEXPR:
+    case BVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        if (bval_in_arena(v->cell[i])) return 1;
+      }
+      return 0;
+
+    case BVAL_FUN:
+      if (BVAL_IS_BUILTIN(v)) return 0;
+      if (bval_in_arena(v->formals) || bval_in_arena(v->body)) return 1;
+      for (int i = 0; i < v->env->count; i++) {
+        if (bval_in_arena(v->env->vals[i])) return 1;
+      }
+      return 0;
+
+    case BVAL_SEQ:
+      if (v->kind == BSEQ_RANGE) return 0;
+      return bval_in_arena(v->src) || (v->fn && bval_in_arena(v->fn));
+  }
+
+  return 0;
+#endif
+}
+
+
+/**
+ * Make a value safe to outlive the current form: parts allocated in the
+ * form arena are copied out to the pools with the arena paused, anything
+ * already long-lived is shared
+ */
+bval* bval_promote(bval* v) {
+  if (!bval_in_arena(v)) return bval_retain(v);
+
+  bval_arena.paused++;
+  bval* x = bval_copy(v);
+
+  switch (x->type) {
     case BVAL_SEXPR:
     case BVAL_QEXPR:
-      x->count = v->count;
-      x->cell = malloc(sizeof(bval*) * x->count);
+      bval_unshare(x);
       for (int i = 0; i < x->count; i++) {
-        x->cell[i] = bval_copy(v->cell[i]);
+        bval* child = x->cell[i];
+        x->cell[i] = bval_promote(child);
+        bval_del(child);
       }
+      // folded values are old already
+      if (v->code && v->code->fold) x->code = bopt_code(0, v->code->fold);
       break;
+
+    case BVAL_SYM:
+      if (v->inlined) x->inlined = bopt_code(0, v->inlined->fold);
+      break;
+
+    case BVAL_FUN:
+      if (!BVAL_IS_BUILTIN(x)) {
+        bval* formals = x->formals;
+        bval* body = x->body;
+        x->formals = bval_promote(formals);
+        x->body = bval_promote(body);
+        bval_del(formals);
+        bval_del(body);
+
+        x->env->young = 0;
+        for (int i = 0; i < x->env->count; i++) {
+          bval* val = x->env->vals[i];
+          x->env->vals[i] = bval_promote(val);
+          bval_del(val);
+        }
+      }
+      break;
+
+    case BVAL_SEQ: {
+      if (x->kind == BSEQ_RANGE) break;
+      bval* src = x->src;
+      x->src = bval_promote(src);
+      bval_del(src);
+      if (x->fn) {
+        bval* fn = x->fn;
+        x->fn = bval_promote(fn);
+        bval_del(fn);
+      }
+      break;
+    }
   }
 
+  bval_arena.paused--;
   return x;
 }
 
@@ -445,20 +1119,23 @@ bval* bval_copy(bval* v) {
 bval* bval_to_string(bval* v) {
   char buffer[512];
 
-  bval* s = bval_qexpr();
-
-  switch (v->type) {
-    case BVAL_STR:    return v;
+  switch (BVAL_TYPE(v)) {
+    case BVAL_STR:    return bval_retain(v);
     case BVAL_SEXPR:  return bval_expr_to_string(v, "(", ")");
     case BVAL_QEXPR:  return bval_expr_to_string(v, "{", "}");
+    case BVAL_SEQ:    return bseq_to_string(v);
     case BVAL_OK:     return bval_str("ok!");
+  }
+
+  bval* s = bval_qexpr();
 
+  switch (BVAL_TYPE(v)) {
     case BVAL_FUN:
-      if (v->builtin) {
-        snprintf(buffer, sizeof(buffer), "<builtin: %s >", v->sym);
+      if (BVAL_IS_BUILTIN(v)) {
+        snprintf(buffer, sizeof(buffer), "<builtin: %s >", v->info->name);
         bval_add(s, bval_str(buffer));
       } else {
-        bval_add(s, bval_str("(\\ "));
+        bval_add(s, bval_str(v->flags & BVAL_F_MACRO ? "(macro " : "(\\ "));
         bval_add(s, bval_to_string(v->formals));
         bval_add(s, bval_str(" "));
         bval_add(s, bval_to_string(v->body));
@@ -467,10 +1144,10 @@ bval* bval_to_string(bval* v) {
       break;
 
     case BVAL_NUM:
-      if (ceilf(v->num) == v->num) {
-        snprintf(buffer, sizeof(buffer), "%i", ((int) v->num));
+      if (ceilf(bval_number(v)) == bval_number(v)) {
+        snprintf(buffer, sizeof(buffer), "%i", ((int) bval_number(v)));
       } else {
-        snprintf(buffer, sizeof(buffer), "%lf", v->num);
+        snprintf(buffer, sizeof(buffer), "%lf", bval_number(v));
       }
       bval_add(s, bval_str(buffer));
       break;
@@ -486,10 +1163,7 @@ bval* bval_to_string(bval* v) {
       break;
   }
 
-  benv* e = benv_new();
-  bval* out = builtin_join(e, s);
-  benv_del(e);
-  return out;
+  return bval_apply(NULL, builtin_join, s);
 }
 
 
@@ -501,6 +1175,7 @@ bval* bval_to_string(bval* v) {
 void bval_print(bval* v) {
   bval* s = bval_to_string(v);
   printf("%s", s->str);
+  bval_del(s);
 }
 
 
@@ -520,10 +1195,7 @@ bval* bval_expr_to_string(bval* v, char* open, char* close) {
   }
 
   bval_add(s, bval_str(close));
-  benv* e = benv_new();
-  bval* out = builtin_join(e, s);
-  benv_del(e);
-  return out;
+  return bval_apply(NULL, builtin_join, s);
 }
 
 
@@ -546,6 +1218,7 @@ char* btype_name(int type) {
     case BVAL_OK:    return "Ok";
     case BVAL_SEXPR: return "S-Expression";
     case BVAL_QEXPR: return "Q-Expression";
+    case BVAL_SEQ:   return "Sequence";
   }
   return "Invalid";
 }
@@ -0,0 +1,215 @@
+/**
+ * Element blocks
+ *
+ * The elements of a Q/S-expression live in a bvec block which any number
+ * of expressions can share, each viewing a slice of it: an expression's
+ * cell points at element start of its block, and the block holds one
+ * reference to each element from front to back. So a copy of a list shares
+ * its elements in constant time, and tail and init give a narrower slice of
+ * the same block rather than a new array.
+ *
+ * A shared block is never changed where another expression can see it.
+ * Free room past the back of a block, or before its front, is seen by no
+ * one, so an expression ending at the back can still be appended to in
+ * place and one starting at the front can have elements put before it
+ * (cons). Anything else that writes an element makes the block its own
+ * first (bval_unshare, which bval_own does).
+ *
+ * A block is young or old with the expression that made it, and is only
+ * shared between expressions of the same age: an old expression must not
+ * point into the nursery, and a young one dropped with the nursery never
+ * gives back its reference to an old block.
+ */
+bvec* bvec_new(int young, int cap) {
+  bvec* b = bmem_alloc(young, sizeof(bvec) + sizeof(bval*) * cap);
+  b->rc = 1;
+  b->front = 0;
+  b->back = 0;
+  b->cap = cap;
+  b->mark = 0;
+  b->young = young;
+  return b;
+}
+
+
+// new block with count elements from cell, shared, placed after before free
+// slots and followed by after more
+bvec* bvec_from(int young, bval** cell, int count, int before, int after) {
+  bvec* b = bvec_new(young, before + count + after);
+  b->front = b->back = before;
+  for (int i = 0; i < count; i++) {
+    b->cell[b->back++] = bval_retain(cell[i]);
+  }
+  return b;
+}
+
+
+void bvec_release(bvec* b) {
+  if (--b->rc) return;
+  for (int i = b->front; i < b->back; i++) {
+    bval_del(b->cell[i]);
+  }
+  bmem_free(b);
+}
+
+
+// drop the elements of v's block outside v's slice, which only v views
+void bvec_trim(bval* v) {
+  bvec* b = BVEC(v);
+  for (int i = b->front; i < v->start; i++) {
+    bval_del(b->cell[i]);
+  }
+  for (int i = v->start + v->count; i < b->back; i++) {
+    bval_del(b->cell[i]);
+  }
+  b->front = v->start;
+  b->back = v->start + v->count;
+}
+
+
+// point v at count elements of block b from start on
+void bval_view(bval* v, bvec* b, int start, int count) {
+  v->start = start;
+  v->count = count;
+  v->cell = b->cell + start;
+}
+
+
+// whether v may write into its block, which is its own
+int bvec_owned(bval* v) {
+  bvec* b = BVEC(v);
+  return b->rc == 1 && b->young == BVAL_IS_YOUNG(v);
+}
+
+
+/**
+ * Make room to append n elements to v, which the caller owns: past the back
+ * of v's block, growing it when it is v's own or copying it otherwise. A
+ * new block is made exactly as large as asked, so a caller knowing how
+ * many elements are coming reserves them up front; after that a block
+ * grows to at least twice its size, so appending one element at a time
+ * costs amortized constant time
+ */
+void bval_room(bval* v, int n) {
+  int young = BVAL_IS_YOUNG(v);
+
+  if (!v->cell) {
+    bval_view(v, bvec_new(young, n), 0, 0);
+    return;
+  }
+
+  bvec* b = BVEC(v);
+  int end = v->start + v->count;
+
+  if (bvec_owned(v)) {
+    bvec_trim(v);
+    if (end + n > b->cap) {
+      int cap = end + n > 2 * b->cap ? end + n : 2 * b->cap;
+      b = bmem_realloc(young, b, sizeof(bvec) + sizeof(bval*) * cap);
+      b->cap = cap;
+      bval_view(v, b, v->start, v->count);
+    }
+    return;
+  }
+
+  // the slots past the back of a shared block are still free
+  if (b->young == young && end == b->back && end + n <= b->cap) return;
+
+  // a copy with as much room again as it has elements, so appending to a
+  // list that is kept around is linear overall too
+  bvec* x = bvec_from(young, v->cell, v->count, 0, v->count + n);
+  bvec_release(b);
+  bval_view(v, x, 0, v->count);
+}
+
+
+// give v, which the caller owns, a block of its own to write into
+void bval_unshare(bval* v) {
+  if (!v->cell) return;
+
+  if (bvec_owned(v)) {
+    bvec_trim(v);
+    return;
+  }
+
+  bvec* x = bvec_from(BVAL_IS_YOUNG(v), v->cell, v->count, 0, 0);
+  bvec_release(BVEC(v));
+  bval_view(v, x, 0, v->count);
+}
+
+
+// empty v, whose own elements have been taken over or released already,
+// keeping its block until v is deleted
+void bval_clear(bval* v) {
+  if (!v->cell) return;
+
+  bvec_trim(v);
+  bvec* b = BVEC(v);
+  b->back = b->front;
+  v->count = 0;
+}
+
+
+/**
+ * The elements of Q/S-expression v, which is taken over, from index from
+ * up to index to, sharing v's block
+ */
+bval* bval_slice(bval* v, int from, int to) {
+  if (v->rc > 1) {
+    // a new expression viewing the slice, or a copy of just those
+    // elements when the block is of another age
+    bval* x = BVAL_TYPE(v) == BVAL_SEXPR ? bval_sexpr() : bval_qexpr();
+    int young = BVAL_IS_YOUNG(x);
+
+    if (to > from && BVEC(v)->young == young) {
+      BVEC(v)->rc++;
+      bval_view(x, BVEC(v), v->start + from, to - from);
+    } else if (to > from) {
+      bval_view(x, bvec_from(young, v->cell + from, to - from, 0, 0), 0, to - from);
+    }
+
+    bval_del(v);
+    return x;
+  }
+
+  bvm_free(v->code);
+  v->code = NULL;
+  if (!v->cell) return v;
+
+  bvec* b = BVEC(v);
+  bval_view(v, b, v->start + from, to - from);
+  if (bvec_owned(v)) bvec_trim(v);
+
+  if (!v->count) {
+    bvec_release(b);
+    v->cell = NULL;
+    v->start = 0;
+  }
+  return v;
+}
+
+
+/**
+ * Q/S-expression v, which is taken over, with x put in front of its
+ * elements: in place when v starts at the front of its block and there is
+ * room before it, otherwise in a new block with as much room in front as v
+ * has elements, so building a list by cons is linear overall
+ */
+bval* bval_prepend(bval* x, bval* v) {
+  v = bval_slice(v, 0, v->count);
+
+  int young = BVAL_IS_YOUNG(v);
+  bvec* b = v->cell ? BVEC(v) : NULL;
+
+  if (b && b->young == young && v->start == b->front && b->front > 0) {
+    b->cell[--b->front] = x;
+    bval_view(v, b, v->start - 1, v->count + 1);
+    return v;
+  }
+
+  bvec* y = bvec_from(young, v->cell, v->count, v->count + 1, 0);
+  y->cell[--y->front] = x;
+  if (b) bvec_release(b);
+  bval_view(v, y, y->front, v->count + 1);
+  return v;
+}
@@ -0,0 +1,431 @@
+/**
+ * Bytecode VM
+ *
+ * Evaluating a lambda body with the tree walker copies the body, sends
+ * every element back through bval_eval and works out again on each call
+ * what every element is. Instead a body is compiled once, when the lambda
+ * is built, into a flat list of stack machine instructions that bval_call
+ * runs in the call frame.
+ *
+ * The instructions follow bval_eval_sexpr exactly: elements are evaluated
+ * left to right, an error anywhere is the result of the whole body, and an
+ * S-expression of n values applies the first to the rest, unless the first
+ * turns out to be a macro, which is given the forms instead (BVM_MACRO,
+ * see bmac.c). The one special case is if: when (if c {a} {b}) turns out
+ * at run time to be a call of the if builtin with a number, the chosen
+ * branch runs as compiled code instead of being handed to builtin_if as
+ * data. Any other head, or a condition of the wrong type, takes the
+ * generic path.
+ *
+ * The call giving a body its value, including through the branches of an
+ * inline if, is compiled as a tail call. Rather than growing the C stack,
+ * bvm_run hands a lambda in tail position, or the expression chosen by the
+ * if or eval builtins, back to bvm_exec, which runs it in place of the
+ * finished body: tail recursion loops in constant stack.
+ *
+ * Running with --no-vm keeps every call on the tree walker, to compare.
+ */
+int bvm_enabled = 1;
+
+
+void bvm_emit(bcomp* c, int op) {
+  if (c->count == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 32;
+    c->ops = realloc(c->ops, sizeof(int) * c->cap);
+  }
+  c->ops[c->count++] = op;
+}
+
+
+int bvm_const(bcomp* c, bval* v) {
+  if (c->nconsts == c->cap_consts) {
+    c->cap_consts = c->cap_consts ? c->cap_consts * 2 : 16;
+    c->consts = realloc(c->consts, sizeof(bval*) * c->cap_consts);
+  }
+  c->consts[c->nconsts] = v;
+  return c->nconsts++;
+}
+
+
+// track the stack height to size the VM stack
+void bvm_push(bcomp* c, int n) {
+  c->depth += n;
+  if (c->depth > c->max_depth) c->max_depth = c->depth;
+}
+
+
+// (if c {a} {b})
+int bvm_is_if(bval* v) {
+  return v->count == 4
+    && BVAL_TYPE(v->cell[0]) == BVAL_SYM
+    && v->cell[0]->sym == bsym_if
+    && BVAL_TYPE(v->cell[2]) == BVAL_QEXPR
+    && BVAL_TYPE(v->cell[3]) == BVAL_QEXPR;
+}
+
+
+// push the value of v, as bval_eval would
+void bvm_compile_expr(bcomp* c, bval* v) {
+  switch (BVAL_TYPE(v)) {
+    case BVAL_SYM:
+      bvm_emit(c, BVM_LOOKUP);
+      bvm_emit(c, bvm_const(c, v));
+      bvm_push(c, 1);
+      break;
+
+    case BVAL_SEXPR:
+      bvm_compile_sexpr(c, v, 0);
+      break;
+
+    default:
+      bvm_emit(c, BVM_CONST);
+      bvm_emit(c, bvm_const(c, v));
+      bvm_push(c, 1);
+  }
+}
+
+
+// push the value of the elements of v evaluated as an S-expression, as a
+// tail call if the value is the value of the body
+void bvm_compile_sexpr(bcomp* c, bval* v, int tail) {
+  if (!v->code || !v->code->fold) {
+    bvm_compile_call(c, v, tail);
+    return;
+  }
+
+  // a folded S-expression skips its generic code while the fold holds
+  bvm_emit(c, BVM_FOLD);
+  bvm_emit(c, bvm_const(c, v));
+  int end = c->count;
+  bvm_emit(c, 0);
+  bvm_push(c, 1);
+  bvm_push(c, -1);
+
+  bvm_compile_call(c, v, tail);
+  c->ops[end] = c->count;
+}
+
+
+void bvm_compile_call(bcomp* c, bval* v, int tail) {
+  int apply = tail ? BVM_TAIL : BVM_APPLY;
+  if (v->count == 0) {
+    bvm_emit(c, apply);
+    bvm_emit(c, 0);
+    bvm_push(c, 1);
+    return;
+  }
+
+  // a lone S-expression has the value of the one it holds, which keeps its
+  // tail position
+  if (v->count == 1 && BVAL_TYPE(v->cell[0]) == BVAL_SEXPR) {
+    bvm_compile_sexpr(c, v->cell[0], tail);
+    return;
+  }
+
+  // a head that may turn out to be a macro is checked before the rest
+  bvm_compile_expr(c, v->cell[0]);
+  int end = -1;
+  int head = BVAL_TYPE(v->cell[0]);
+  if (head == BVAL_SYM || head == BVAL_SEXPR) {
+    bvm_emit(c, BVM_MACRO);
+    bvm_emit(c, bvm_const(c, v));
+    bvm_emit(c, tail);
+    end = c->count;
+    bvm_emit(c, 0);
+  }
+
+  if (!bvm_is_if(v)) {
+    for (int i = 1; i < v->count; i++) bvm_compile_expr(c, v->cell[i]);
+    bvm_emit(c, apply);
+    bvm_emit(c, v->count);
+    bvm_push(c, 1 - v->count);
+    if (end >= 0) c->ops[end] = c->count;
+    return;
+  }
+
+  // condition, which BVM_IF checks with the head
+  bvm_compile_expr(c, v->cell[1]);
+
+  bvm_emit(c, BVM_IF);
+  int at = c->count;
+  bvm_emit(c, 0);
+  bvm_emit(c, 0);
+  bvm_push(c, -2);
+
+  // then branch
+  bvm_compile_sexpr(c, v->cell[2], tail);
+  bvm_emit(c, BVM_JUMP);
+  int then_end = c->count;
+  bvm_emit(c, 0);
+  bvm_push(c, -1);
+
+  // else branch
+  c->ops[at] = c->count;
+  bvm_compile_sexpr(c, v->cell[3], tail);
+  bvm_emit(c, BVM_JUMP);
+  int else_end = c->count;
+  bvm_emit(c, 0);
+  bvm_push(c, -1);
+
+  // generic call, head and condition are still on the stack
+  c->ops[at + 1] = c->count;
+  bvm_push(c, 2);
+  bvm_compile_expr(c, v->cell[2]);
+  bvm_compile_expr(c, v->cell[3]);
+  bvm_emit(c, apply);
+  bvm_emit(c, 4);
+  bvm_push(c, -3);
+
+  c->ops[then_end] = c->count;
+  c->ops[else_end] = c->count;
+  if (end >= 0) c->ops[end] = c->count;
+}
+
+
+// code and constants share one block, owned by body
+bcode* bvm_compile(bval* body) {
+  bcomp c = { NULL, 0, 0, NULL, 0, 0, 0, 0 };
+
+  bvm_compile_sexpr(&c, body, 1);
+  bvm_emit(&c, BVM_RETURN);
+
+  size_t ops = sizeof(int) * c.count;
+  size_t consts = sizeof(bval*) * c.nconsts;
+  size_t start = BPOOL_CLASS(sizeof(bcode));
+  char* block = bmem_alloc(BVAL_IS_YOUNG(body), start + consts + ops);
+
+  bcode* code = (bcode*) block;
+  memset(code, 0, sizeof(bcode));
+  code->count = c.count;
+  code->depth = c.max_depth;
+  code->consts = (bval**) (block + start);
+  code->ops = (int*) (block + start + consts);
+  memcpy(code->consts, c.consts, consts);
+  memcpy(code->ops, c.ops, ops);
+
+  free(c.ops);
+  free(c.consts);
+  return code;
+}
+
+
+bcode* bvm_code(bval* body) {
+  if (!body->code) body->code = bvm_compile(body);
+  return body->code;
+}
+
+
+void bvm_free(bcode* code) {
+  if (!code) return;
+  if (code->jit) bjit_free(code->jit);
+  if (code->fold && code->fold->value) bval_del(code->fold->value);
+  bmem_free(code);
+}
+
+
+// a frame binding the plain formals of f to n arguments, which it takes
+// over
+benv* bvm_frame(bval* f, bval** args, int n) {
+  benv* frame = benv_new();
+  frame->count = n;
+  benv_alloc_slots(frame);
+
+  for (int i = 0; i < n; i++) {
+    frame->syms[i] = f->formals->cell[i]->sym;
+    BSYM(frame->syms[i])->shadows++;
+
+    if (frame->young) {
+      frame->vals[i] = args[i];
+    } else {
+      frame->vals[i] = bval_promote(args[i]);
+      bval_del(args[i]);
+    }
+  }
+  if (n > BENV_INDEX_MIN) benv_index_build(frame);
+
+  return frame;
+}
+
+
+// call f with a frame made from n arguments, which it takes over
+bval* bvm_call(benv* e, bval* f, bval** args, int n) {
+  benv* frame = bvm_frame(f, args, n);
+  frame->parent = e;
+  return bvm_exec(frame, f->body);
+}
+
+
+// run body in frame e, which it takes over, then any tail calls it makes
+bval* bvm_exec(benv* e, bval* body) {
+  body = bval_retain(body);
+
+  while (1) {
+    bgc_safepoint(e);
+    btail t = { NULL, NULL };
+    bcode* code = bvm_code(body);
+    bval* r = code->jit ? bjit_run(code->jit, e, body) : NULL;
+    if (!r) r = bvm_run(e, code, &t);
+    bval_del(body);
+
+    if (r) {
+      benv_del(e);
+      return r;
+    }
+
+    // a lambda's frame replaces the finished one, if or eval reuse it
+    if (t.frame) {
+      benv_splice(t.frame, e);
+      e = t.frame;
+    }
+    body = t.body;
+  }
+}
+
+
+bval* bvm_run(benv* e, bcode* code, btail* tail) {
+  bval* stack[code->depth];
+  int sp = 0;
+  int pc = 0;
+  int* ops = code->ops;
+
+  while (1) {
+    int op = ops[pc++];
+    switch (op) {
+      case BVM_CONST:
+        stack[sp++] = bval_retain(code->consts[ops[pc++]]);
+        break;
+
+      case BVM_LOOKUP:
+        stack[sp++] = benv_get(e, code->consts[ops[pc++]]);
+        break;
+
+      case BVM_APPLY:
+      case BVM_TAIL: {
+        int n = ops[pc++];
+
+        if (n == 0) {
+          stack[sp++] = bval_sexpr();
+          break;
+        }
+        if (n == 1) break;
+
+        sp -= n;
+        bval* f = stack[sp];
+
+        if (BVAL_TYPE(f) != BVAL_FUN) {
+          stack[sp++] = bval_err(
+            "S-expression starts with incorrect type!"
+            "Given type %s, Expected type %s",
+            btype_name(BVAL_TYPE(f)), btype_name(BVAL_FUN)
+          );
+          for (int i = 0; i < n; i++) bval_del(stack[sp + i]);
+          break;
+        }
+
+        // a full call of a lambda with plain formals binds the arguments
+        // straight from the stack
+        if (!BVAL_IS_BUILTIN(f) && (f->formals->flags & BVAL_F_PLAIN)
+            && f->env->count == 0 && f->formals->count == n - 1) {
+          if (op == BVM_TAIL) {
+            tail->frame = bvm_frame(f, &stack[sp + 1], n - 1);
+            tail->body = bval_retain(f->body);
+            bval_del(f);
+            return NULL;
+          }
+          bval* r = bvm_call(e, f, &stack[sp + 1], n - 1);
+          stack[sp++] = r;
+          bval_del(f);
+          break;
+        }
+
+        // the arguments are passed on the stack, which is empty below a
+        // tail call, so the rest of the body can be handed back
+        bval** args = &stack[sp + 1];
+        if (op == BVM_TAIL && BVAL_IS_BUILTIN(f)) {
+          bval* x = bval_tail_expr(f, n - 1, args);
+          if (x) {
+            bval_release(n - 1, args);
+            tail->body = x;
+            bval_del(f);
+            return NULL;
+          }
+        } else if (op == BVM_TAIL) {
+          bval* r = NULL;
+          tail->frame = bval_bind(e, f, n - 1, args, &r);
+          if (tail->frame) {
+            tail->body = bval_retain(f->body);
+            bval_del(f);
+            return NULL;
+          }
+          stack[sp++] = r;
+          bval_del(f);
+          break;
+        }
+
+        stack[sp++] = bval_call(e, f, n - 1, args);
+        bval_del(f);
+        break;
+      }
+
+      case BVM_IF: {
+        bval* f = stack[sp - 2];
+        bval* cond = stack[sp - 1];
+
+        if (BVAL_TYPE(f) != BVAL_FUN || !BVAL_IS_BUILTIN(f)
+            || f->builtin != builtin_if || BVAL_TYPE(cond) != BVAL_NUM) {
+          pc = ops[pc + 1];
+          continue;
+        }
+
+        sp -= 2;
+        int truthy = bval_number(cond) != 0;
+        bval_del(f);
+        bval_del(cond);
+        pc = truthy ? pc + 2 : ops[pc];
+        continue;
+      }
+
+      case BVM_JUMP:
+        pc = ops[pc];
+        continue;
+
+      case BVM_FOLD: {
+        bval* x = bopt_value(code->consts[ops[pc]]);
+        if (!x) {
+          pc += 2;
+          continue;
+        }
+        stack[sp++] = x;
+        pc = ops[pc + 1];
+        continue;
+      }
+
+      case BVM_MACRO: {
+        bval* call = code->consts[ops[pc]];
+        if (!bmac_applies(stack[sp - 1], call->count - 1)) {
+          pc += 3;
+          continue;
+        }
+
+        bval* x = bmac_rewrite(stack[--sp], call);
+        if (ops[pc + 1]) {
+          tail->body = x;
+          return NULL;
+        }
+        stack[sp++] = bval_eval(e, x);
+        pc = ops[pc + 2];
+        break;
+      }
+
+      case BVM_RETURN:
+        return stack[0];
+    }
+
+    // an error is the result of the whole body
+    if (BVAL_TYPE(stack[sp - 1]) == BVAL_ERR) {
+      bval* err = stack[--sp];
+      while (sp) bval_del(stack[--sp]);
+      return err;
+    }
+  }
+}